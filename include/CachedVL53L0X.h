@@ -0,0 +1,54 @@
+/*
+ * A VL53L0X that can skip its slow start.
+ *
+ * The sensor is powered off between wakes, so it has to be set up again
+ * every time. Most of the time sensor.init() spends goes into finding the
+ * reference SPADs and running the VHV and phase calibrations, and the
+ * answers don't change from one wake to the next. init() here does the full
+ * job and keeps the results; warmInit() writes them back in a short burst
+ * and skips the searching.
+ *
+ * The library keeps the stop variable it reads during init() to itself, and
+ * readRangeSingleMillimeters() and startContinuous() need it, so those two
+ * are replaced here with versions that use the saved one.
+ */
+
+#ifndef CACHED_VL53L0X_H
+#define CACHED_VL53L0X_H
+
+#include <Arduino.h>
+#include <VL53L0X.h>
+
+#define VL53L0X_CALIBRATION_FLAG 0xCA1B // stamp on a good calibration
+#define VL53L0X_SPAD_MAP_SIZE 6
+
+typedef struct
+    {
+    uint16_t valid;         // VL53L0X_CALIBRATION_FLAG if the rest can be used
+    uint8_t stopVariable;
+    uint8_t spadMap[VL53L0X_SPAD_MAP_SIZE]; // reference SPADs to enable
+    uint8_t vhvSettings;    // result of the VHV calibration
+    uint8_t phaseCal;       // result of the phase calibration
+    } VL53L0XCalibration;
+
+class CachedVL53L0X : public VL53L0X
+    {
+    public:
+        bool init(bool io_2v8=true);
+        bool warmInit(const VL53L0XCalibration& calibration, bool io_2v8=true);
+        void captureCalibration();
+        const VL53L0XCalibration& getCalibration();
+        void startContinuous(uint32_t period_ms=0);
+        bool startRangeSingle();
+        uint16_t readRangeSingleMillimeters();
+        bool timeoutOccurred();
+
+    private:
+        VL53L0XCalibration _calibration={};
+        bool _timedOut=false;
+        void _writeStopVariable();
+        void _openCalibrationPage();
+        void _closeCalibrationPage();
+    };
+
+#endif // CACHED_VL53L0X_H
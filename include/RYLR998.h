@@ -12,14 +12,257 @@
 #include <SoftwareSerial.h>
 #include <ArduinoJson.h>
 
+#define LORA_COMMAND_QUEUE_SIZE 8   // max number of AT commands waiting to be sent
+#define LORA_COMMAND_SIZE 48        // longest queued AT command, including the terminator
+#define LORA_RESPONSE_SIZE 48       // longest reply we keep for a queued command
+#define LORA_LINE_SIZE 256          // longest line from the module (+RCV with 240 bytes of data)
+#define LORA_RX_RING_SIZE 512       // bytes buffered from the module, must be a power of 2
+#define LORA_RX_BURST 64            // most bytes moved from the UART per call
+#define LORA_DEFAULT_TIMEOUT 2000   // milliseconds to wait for a reply to a command
+#define LORA_BEGIN_TIMEOUT 3000     // milliseconds begin() may spend looking for the module
+#define LORA_PROBE_TIMEOUT 250      // milliseconds to wait for an answer at each baud rate
+#define LORA_MAX_ATTEMPTS 3         // tries per command before giving up
+#define LORA_MAX_CALL_TIME 4500UL   // most milliseconds one blocking call spends, retries included
+#define LORA_TX_BUSY_WAIT 200       // milliseconds to let the last transmission finish after +ERR=17
+#define LORA_RESYNC_WAIT 50         // milliseconds to let the module settle after a resync
+#define LORA_BENCH_IDLE_TIME 100000UL // microseconds benchmarkLink() times its loop with nothing arriving
+#ifndef LORA_RX_QUEUE_DEPTH
+#define LORA_RX_QUEUE_DEPTH 8       // received frames held in drain mode
+#endif
+static_assert((LORA_RX_RING_SIZE & (LORA_RX_RING_SIZE-1))==0, "LORA_RX_RING_SIZE must be a power of 2");
+
+// A received +RCV frame. The payload points into the line it was parsed from,
+// so it is only valid until the next call into the driver.
+typedef struct
+    {
+    uint16_t address;
+    uint16_t length;      // length reported by the module
+    const char* payload;  // not null terminated
+    size_t payloadLen;
+    int16_t rssi;
+    int16_t snr;
+    } RcvFrame;
+
+// Compact binary report, sent instead of JSON to save time on air. It goes
+// out as LORA_FRAME_MARKER followed by the packed bytes in unpadded base64url,
+// which the AT+SEND command carries without trouble.
+// A version 2 frame adds a count and the readings the node buffered while it slept.
+#define LORA_FRAME_MARKER '#'
+#define LORA_FRAME_VERSION 1        // a single report
+#define LORA_FRAME_VERSION_BATCH 2  // a report plus buffered readings
+#define LORA_FRAME_BYTES 8          // packed size of a single report
+#define LORA_READING_BYTES 6        // packed size of each buffered reading
+#define LORA_MAX_BATCH 12           // most buffered readings in one frame
+#define LORA_FRAME_MAX_BYTES (LORA_FRAME_BYTES+1+LORA_MAX_BATCH*LORA_READING_BYTES)
+#define LORA_FRAME_TEXT_SIZE (2+(LORA_FRAME_MAX_BYTES*8+5)/6)    // encoded size, with marker and terminator
+#define LORA_REPORT_TEXT_LENGTH (1+(LORA_FRAME_BYTES*8+5)/6)     // encoded length of a single report
+#define LORA_FLAG_PRESENT 0x01      // a package is in the box
+#define LORA_DISTANCE_INVALID 0xFFFF
+
+typedef struct
+    {
+    uint16_t age;           // seconds before the report was sent
+    uint16_t distance;
+    uint16_t batteryMv;
+    } BatchReading;
+
+typedef struct
+    {
+    uint8_t version;        // filled in by encodeReport()
+    uint8_t flags;
+    uint16_t sequence;
+    uint16_t distance;      // mm, LORA_DISTANCE_INVALID if the ranging failed
+    uint16_t batteryMv;
+    uint8_t readingCount;   // buffered readings that follow, oldest first
+    BatchReading readings[LORA_MAX_BATCH];
+    } ReportFrame;
+
+// What the driver knows about each sender it has heard from. The table is
+// sized at compile time and must be a power of 2; keep it about twice the
+// number of senders. At 20 bytes an entry the default takes 10KB, so a node
+// that only hears its gateway should build with a small size.
+#ifndef LORA_NODE_TABLE_SIZE
+#define LORA_NODE_TABLE_SIZE 512
+#endif
+// The probe in _findNode() wraps with a mask, and would never end otherwise
+static_assert(LORA_NODE_TABLE_SIZE>0 && (LORA_NODE_TABLE_SIZE & (LORA_NODE_TABLE_SIZE-1))==0, "LORA_NODE_TABLE_SIZE must be a power of 2");
+#define LORA_EWMA_SHIFT 3           // signal averages move 1/8 of the way toward each frame
+#define NODE_USED 0x01
+#define NODE_HAS_SEQUENCE 0x02      // lastSequence came from a report
+
+typedef struct
+    {
+    uint32_t lastSeen;      // millis() of the last frame
+    uint32_t frames;        // frames received, repeats included
+    uint16_t address;
+    uint16_t lastSequence;
+    int16_t rssiAvg;        // moving average of rssi, in 1/16 dB
+    int16_t snrAvg;         // moving average of snr, in 1/16 dB
+    uint16_t duplicates;    // repeated reports
+    uint8_t flags;
+    } NodeEntry;
+
+// A frame taken in drain mode, with its own copy of the line it came from
+typedef struct
+    {
+    RcvFrame frame;         // the payload points into line
+    bool decoded;           // report holds a decoded binary report
+    bool duplicate;         // a repeat of the sender's last report, ack it but don't act on it
+    ReportFrame report;
+    char line[LORA_LINE_SIZE];
+    } ReceivedFrame;
+
+// Bandwidth in Hz for an AT+PARAMETER bandwidth code
+constexpr uint32_t loraBandwidthHz(uint8_t code)
+    {
+    return code==0?7800:code==1?10400:code==2?15600:code==3?20800:code==4?31250:
+           code==5?41700:code==6?62500:code==7?125000:code==8?250000:500000;
+    }
+
+/*
+ * Estimated time on air of one packet in microseconds, from the SX126x
+ * datasheet formula (the RYLR998 is built on an SX1262). Assumes an explicit
+ * header and CRC, which is what the module uses. Arguments are the
+ * AT+PARAMETER codes and the AT+SEND payload length.
+ */
+constexpr uint32_t loraTimeOnAir(uint8_t sf, uint8_t bwCode, uint8_t cr, uint8_t preamble, size_t payloadLen)
+    {
+    uint32_t symbolUs=(1000000UL<<sf)/loraBandwidthHz(bwCode);
+    bool lowDataRate=symbolUs>16000;             //the module turns on LDRO for long symbols
+    int32_t bits=8*(int32_t)payloadLen+16-4*sf+20+(sf<7?0:8);
+    int32_t bitsPerSymbol=4*(sf-(lowDataRate?2:0));
+    int32_t blocks=bits>0?(bits+bitsPerSymbol-1)/bitsPerSymbol:0;
+    uint32_t quarterSymbols=4*(preamble+8)+(sf<7?25:17)+4*blocks*(cr+4); //preamble has 4.25 or 6.25 extra symbols
+    return quarterSymbols*symbolUs/4;
+    }
+
+// Outcome of a command. Positive values are the module's own +ERR=n codes.
+enum LoraResult : int8_t
+    {
+    LORA_OK=0,
+    LORA_TIMEOUT=-1,
+    LORA_QUEUE_FULL=-2,
+    LORA_UNEXPECTED=-3,         // a reply we couldn't make sense of
+    LORA_ERR_NO_CRLF=1,
+    LORA_ERR_NOT_AT=2,          // often bogus, the module lost track of the line
+    LORA_ERR_UNKNOWN_COMMAND=4,
+    LORA_ERR_LENGTH=5,
+    LORA_ERR_TX_TIMEOUT=10,
+    LORA_ERR_CRC=12,
+    LORA_ERR_TOO_LONG=13,
+    LORA_ERR_FLASH=14,
+    LORA_ERR_UNKNOWN=15,
+    LORA_ERR_TX_BUSY=17,        // last transmission not finished yet
+    LORA_ERR_PREAMBLE=18,
+    LORA_ERR_RX_HEADER=19
+    };
+
+// The persistent radio settings we manage. An empty cpin leaves the password alone.
+typedef struct
+    {
+    uint16_t address;
+    uint8_t networkID;
+    uint32_t band;
+    uint8_t spreadingFactor;
+    uint8_t bandwidth;
+    uint8_t codingRate;
+    uint8_t preamble;
+    char cpin[9];
+    uint8_t power;
+    } RadioConfig;
+
+// Everything queryAll() reads back from the module
+typedef struct
+    {
+    RadioConfig config;
+    char mode[16];
+    uint32_t baudRate;
+    } RadioState;
+
+// Command types we keep timing statistics for
+enum LoraCommandType {LORA_CMD_TEST, LORA_CMD_SEND, LORA_CMD_SET, LORA_CMD_QUERY, LORA_CMD_OTHER, LORA_CMD_TYPES};
+#define LORA_MAX_ERROR_CODE 19      // highest +ERR=n the module documents
+
+typedef struct
+    {
+    uint16_t count;
+    uint16_t timeouts;
+    uint16_t minMs;     // only meaningful when count>timeouts
+    uint16_t maxMs;
+    uint32_t totalMs;   // mean is totalMs/(count-timeouts)
+    } CommandStats;
+
+// What benchmarkLink() found
+typedef struct
+    {
+    uint16_t rounds;        // replies asked for
+    uint16_t errors;        // replies that never came or came back damaged
+    uint32_t bytes;         // received, line endings included
+    float usPerByte;        // CPU time taking them in, interrupts included
+    } LinkBenchmark;
+
+// Small enough to be carried across deep sleep in RTC memory
+typedef struct
+    {
+    CommandStats commands[LORA_CMD_TYPES];
+    uint16_t errors[LORA_MAX_ERROR_CODE+1]; // count of each +ERR=n, undocumented codes in [0]
+    } RadioStats;
+
+// Called when a queued command completes. The response is empty if the command timed out.
+typedef void (*LoraCallback)(int handle, const char* response, bool timedOut);
+
 class RYLR998 
     {
     public:
         RYLR998(int rx, int tx);
-        void begin(long baudRate);
+        RYLR998(HardwareSerial& port, bool swap=false);
+        RYLR998(Stream& stream);
+        bool begin(long baudRate, unsigned long timeout=LORA_BEGIN_TIMEOUT);
+        long getDetectedBaudRate();
+        unsigned long getDiscoveryTime();
         void setJsonDocument(StaticJsonDocument<250>& doc);
         bool handleIncoming();
+        bool waitForFrame(unsigned long timeout);
+        bool channelClear(unsigned long listenTime);
+        void expandFrame(const RcvFrame& frame, const ReportFrame* report, StaticJsonDocument<250>& doc);
+        void setDrainMode(bool enabled);
+        int drain();
+        const ReceivedFrame* readFrame();
+        uint32_t getDroppedFrames();
+        void service();
+        int queueCommand(const char* command, LoraCallback callback=nullptr, unsigned long timeout=LORA_DEFAULT_TIMEOUT);
+        int queueSend(uint16_t address, const uint8_t* data, size_t len, unsigned long timeout=LORA_DEFAULT_TIMEOUT);
+        bool isComplete(int handle);
+        bool isTimedOut(int handle);
+        const char* getResponse(int handle);
+        LoraResult getResult(int handle);
+        void release(int handle);
+        bool isBusy();
+        const RadioStats& getStats();
+        void setStats(const RadioStats& stats);
+        void clearStats();
+        void printStats(Print& out);
+        LinkBenchmark benchmarkLink(Print& out, int rounds);
+        uint32_t getRxOverflows();
+        uint32_t getTruncatedLines();
+        void setDuplicateFilter(bool enabled);
+        bool wasDuplicate();
+        uint16_t getLastAddress();
+        uint32_t getDuplicateCount();
+        const NodeEntry* getNode(uint16_t address);
+        const NodeEntry* getNodeAt(uint16_t slot);
+        uint16_t getNodeCount();
+        void clearNodes();
+        const ReportFrame& getLastReport();
+        static bool parseRcv(const char* line, RcvFrame& frame);
+        static size_t encodeReport(const ReportFrame& report, char* out, size_t size);
+        static bool decodeReport(const char* data, size_t len, ReportFrame& report);
+        bool applyConfig(const RadioConfig& config);
+        bool queryAll(unsigned long timeout=LORA_DEFAULT_TIMEOUT);
+        const RadioState& getState();
+        void invalidateShadow();
         bool send(uint16_t address, const String& data);
+        bool send(uint16_t address, const uint8_t* data, size_t len);
         bool setMode(uint8_t mode, uint16_t rxTime = 0, uint16_t lowSpeedTime = 0);
         bool setBand(uint32_t frequency);
         bool setParameter(uint8_t sf, uint8_t bw, uint8_t cr, uint8_t preamble);
@@ -30,6 +273,7 @@ class RYLR998
         bool setBaudRate(uint32_t baudrate);
         bool setdebug(bool debugMode);
         bool testComm();
+        LoraResult getLastResult();
         String getMode();
         String getBand();
         String getParameter();
@@ -40,13 +284,87 @@ class RYLR998
         String getBaudRate();
 
     private:
-        SoftwareSerial _serial;
+        enum SlotState {SLOT_FREE, SLOT_QUEUED, SLOT_ACTIVE, SLOT_DONE};
+        typedef struct
+            {
+            SlotState state;
+            bool timedOut;
+            uint32_t ticket;        // queue order
+            unsigned long timeout;
+            unsigned long started;
+            LoraCallback callback;
+            const uint8_t* data;    // AT+SEND payload written after the command, not copied
+            size_t dataLen;
+            char command[LORA_COMMAND_SIZE];
+            char response[LORA_RESPONSE_SIZE];
+            } CommandSlot;
+
+        enum Transport {TRANSPORT_SOFTWARE, TRANSPORT_HARDWARE, TRANSPORT_STREAM};
+        Transport _transport;
+        SoftwareSerial _softSerial;    // only used with TRANSPORT_SOFTWARE
+        HardwareSerial* _hardSerial;   // only used with TRANSPORT_HARDWARE
+        bool _swap=false;              // move the hardware UART to GPIO13/15
+        Stream* _serial;               // whichever of the above we talk through
         int8_t _rxPin;
         int8_t _txPin;
         bool _debug=false;
+        LoraResult _lastResult=LORA_OK;
+        long _detectedBaudRate=0;       // rate the module answered at, 0 if it didn't
+        unsigned long _discoveryTime=0; // milliseconds begin() took
         StaticJsonDocument<250>* _doc;
-        String _sendCommand(const String& command, unsigned long timeout = 2000);
-        void _parseRcvString(const String& input, String& address, String& length, String& jsonData, String& rssi, String& snr);
+        enum QueryField {QUERY_ADDRESS=0x01, QUERY_NETWORKID=0x02, QUERY_BAND=0x04, QUERY_IPR=0x08,
+                         QUERY_MODE=0x10, QUERY_PARAMETER=0x20, QUERY_CPIN=0x40, QUERY_CRFOP=0x80};
+        RadioState _shadow;         // what we believe the module holds
+        bool _shadowValid=false;
+        RadioStats _stats;
+        NodeEntry _nodes[LORA_NODE_TABLE_SIZE]; // every sender we've heard from
+        uint16_t _nodeCount=0;
+        bool _filterDuplicates=true;
+        bool _duplicate=false;          // the last frame was a repeat and was not expanded
+        ReportFrame _lastReport;        // the last binary report decoded
+        uint16_t _lastAddress=0;
+        uint32_t _duplicates=0;
+        CommandSlot _slots[LORA_COMMAND_QUEUE_SIZE];
+        int _active=-1;             // slot waiting for a reply, or -1
+        uint32_t _nextTicket=0;
+        uint8_t _rxRing[LORA_RX_RING_SIZE]; // raw bytes from the module, not yet split into lines
+        uint16_t _rxHead=0;         // next byte to write
+        uint16_t _rxTail=0;         // next byte to read
+        uint16_t _rxLines=0;        // complete lines waiting in the ring
+        uint32_t _rxOverflows=0;    // bytes dropped because the ring was full
+        uint32_t _truncatedLines=0; // lines longer than LORA_LINE_SIZE
+        char _line[LORA_LINE_SIZE]; // the last complete line taken from the ring
+        char _rcvLine[LORA_LINE_SIZE]; // last unsolicited +RCV line, waiting for handleIncoming()
+        bool _rcvPending=false;
+        uint32_t _framesHeard=0;    // +RCV lines seen, for channelClear()
+        bool _drainMode=false;
+        ReceivedFrame _rxQueue[LORA_RX_QUEUE_DEPTH]; // decoded frames waiting for readFrame()
+        uint8_t _rxQueueHead=0;     // oldest frame
+        uint8_t _rxQueueCount=0;    // including the one readFrame() last returned
+        bool _rxFrameHeld=false;    // the head is still in use by readFrame()'s caller
+        uint32_t _droppedFrames=0;  // frames that arrived with the queue full
+        void _pump();
+        bool _readLine();
+        void _dispatchLine();
+        void _complete(int slot, bool timedOut);
+        void _startNext();
+        int _queue(const char* command, const uint8_t* data, size_t len, LoraCallback callback, unsigned long timeout);
+        bool _acceptFrame(const char* line, RcvFrame& frame, ReportFrame& report, bool& decoded, bool& duplicate);
+        void _queueFrame(const char* line);
+        NodeEntry& _findNode(uint16_t address);
+        bool _trackNode(const RcvFrame& frame, const ReportFrame* report);
+        void _record(const char* command, unsigned long latency, bool timedOut, const char* response);
+        void _openSerial(long baudRate);
+        uint8_t _parseQueryReply(const char* line);
+        int _startRaw(const char* header, const uint8_t* data, size_t len, unsigned long timeout);
+        LoraResult _await(int handle, char* response, size_t size);
+        LoraResult _sendCommand(const char* command, char* response, size_t size, unsigned long timeout = LORA_DEFAULT_TIMEOUT);
+        LoraResult _execute(const char* command, char* response, size_t size, unsigned long timeout = LORA_DEFAULT_TIMEOUT);
+        bool _setCommand(const char* command);
+        bool _retry(LoraResult result, int attempt, unsigned long start, bool resend);
+        unsigned long _attemptTimeout(unsigned long timeout, unsigned long start);
+        void _resync();
+        void _pause(unsigned long ms);
     };
 
 #endif // RYLR998_H
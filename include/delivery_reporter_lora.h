@@ -11,7 +11,7 @@
 #define LORA_OFF false
 #define MAX_HARDWARE_FAILURES 20
 #define VALID_SETTINGS_FLAG 0xDAB0
-#define JSON_MESSAGE_SIZE 50
+#define VALID_RTC_FLAG 0xDAB1
 #define LORA_ENABLE_PIN D3
 #define LORA_ENABLE LOW
 #define LORA_DISABLE HIGH
@@ -28,14 +28,36 @@
 #define DEFAULT_LORA_CODING_RATE 1
 #define DEFAULT_LORA_PREAMBLE 12
 #define DEFAULT_LORA_BAUD_RATE 115200
+#define ADR_HISTORY 4         //acks that must all show spare margin before turning the power down
+#define ADR_TARGET_MARGIN 10  //dB of link margin to keep in hand
+#define ADR_POWER_STEP 2      //dB per ADR power change
+#define ADR_MIN_POWER 2       //dBm, never go below this
+#define ADR_MISSED_LIMIT 2    //missed acks in a row before going back to full power
+#define LBT_MAX_TRIES 4       //times to find the channel busy before sending anyway
+#define LORA_BENCH_ROUNDS 100 //replies lorabench asks for when not told how many
+#define BACKOFF_SLOT 100      //milliseconds, the unit of the random transmit backoff
+#define BACKOFF_MAX_EXPONENT 5 //backoff windows stop doubling at this many slots squared
 #define JSON_STATUS_SIZE SSID_SIZE+PASSWORD_SIZE+USERNAME_SIZE+MQTT_TOPIC_SIZE+150 //+150 for associated field names, etc
+#define ACK_PAYLOAD_SIZE 16 //bytes in the receiver's ack, for estimating its time on air
+#define ACK_TURNAROUND_TIME 500 //milliseconds for the receiver to process a report and start its ack
+#define ACK_MIN_WAIT 2500 //never wait less than this for an ack, until field round trips say otherwise
 #define PUBLISH_DELAY 400 //milliseconds to wait after publishing to MQTT to allow transaction to finish
 #define WIFI_TIMEOUT_SECONDS 20 // give up on wifi after this long
 //#define MAX_CHANGE_PCT 2 //percent distance change must be greater than this before reporting
 #define FULL_BATTERY_COUNT 3686 //raw A0 count with a freshly charged 18650 lithium battery 
 #define FULL_BATTERY_VOLTS 412 //4.12 volts for a fully charged 18650 lithium battery 
 #define ONE_HOUR 3600000 //milliseconds
-#define SAMPLE_COUNT 5 //number of samples to take per measurement 
+#define SAMPLE_COUNT 5 //most samples to take per measurement 
+#define DEFAULT_CONSENSUS_TOLERANCE 10 //mm, samples this close to each other agree
+#define DEFAULT_CONSENSUS_COUNT 3 //a measurement is done when this many samples agree
+#define QUICK_CHECK_MARGIN 5 //mm a quick range may stray beyond the last measurement's spread
+#define SENSOR_TIMEOUT 500 //milliseconds to wait for the VL53L0X to finish a range
+#define DEFAULT_TIMING_BUDGET 33000 //microseconds per range, the VL53L0X default
+#define DEFAULT_VCSEL_PRE_RANGE 14  //pre-range laser pulse period in PCLKs, even, 12-18
+#define DEFAULT_VCSEL_FINAL_RANGE 10 //final range laser pulse period in PCLKs, even, 8-14
+#define DEFAULT_SIGNAL_RATE_LIMIT 0.25 //MCPS, weaker returns than this are not ranged
+#define SWEEP_SAMPLES 10 //ranges per profile in the cold boot sweep
+#define SENSOR_CALIBRATION_LIFE 1000 //wakes before the sensor gets a full calibration again
 
 #define SCREEN_WIDTH 128      // OLED display width, in pixels
 #define SCREEN_HEIGHT 32      // OLED display height, in pixels
@@ -43,6 +65,7 @@
 #define SCREEN_ADDRESS 0x3C   //< See datasheet for Address; 0x3D for 128x64, 0x3C for 128x32
 #define DOT_RADIUS    2       // radius of activity dot
 #define DOT_SPACING   4       // spacing between dots
+#define RADIO_DOT_INTERVAL 250 // milliseconds between activity dots while waiting on the radio
 
 #define RSSI_DOT_RADIUS 2       // Radius of the little dot at the bottom of the wifi indicator
 
@@ -70,21 +93,45 @@
 unsigned long myMillis();
 bool processCommand(String cmd);
 void checkForCommand();
+void radioWaitStep(uint8_t* dotPosition, unsigned long* nextDot);
 int measure();
+bool findConsensus(int* vals, int count, int needed, int tolerance, int* answer);
+int median(int* vals, int count);
 int getDistance();
+int getContinuousDistance();
+uint16_t waitForRange();
+bool validInterruptPin(int pin);
+void attachSensorInterrupt();
+bool validTimingBudget(uint32_t budget);
+bool validVcselPreRange(int period);
+bool validVcselFinalRange(int period);
+bool validSignalRateLimit(float limit);
+bool applySensorSettings();
+void sweepRangingProfiles();
 void showSettings();
 void showSub(char* topic, bool subgood);
 void initializeSettings();
 int readBattery();
 bool report();
-boolean publish();
+int publish();
 void loadSettings();
+bool fixNewSettings();
+bool badBool(const bool& value);
 boolean saveSettings();
 void saveRTC();
 void serialEvent(); 
 void sendOrNot();
+void bufferReading();
 char* generateMqttClientId(char* mqttId);
+int convertToMillivolts(int raw);
 float convertToVoltage(int raw);
+unsigned long airtime(size_t payloadLen);
+uint8_t loraPower();
+void adaptDataRate();
+unsigned long backoffSlots(uint8_t exponent);
+void backoff(uint8_t exponent);
 void setup(); 
 void loop();
-void incomingData();
\ No newline at end of file
+void incomingData();
+void applyLoRaSettings();
+void loraSettingSaved();
\ No newline at end of file
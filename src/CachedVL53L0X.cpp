@@ -0,0 +1,199 @@
+#include "CachedVL53L0X.h"
+
+// ST's default tuning settings, as the library's init() writes them. Register, value.
+static const uint8_t tuningSettings[][2]=
+    {
+    {0xFF,0x01},{0x00,0x00},
+    {0xFF,0x00},{0x09,0x00},{0x10,0x00},{0x11,0x00},
+    {0x24,0x01},{0x25,0xFF},{0x75,0x00},
+    {0xFF,0x01},{0x4E,0x2C},{0x48,0x00},{0x30,0x20},
+    {0xFF,0x00},{0x30,0x09},{0x54,0x00},{0x31,0x04},{0x32,0x03},{0x40,0x83},
+    {0x46,0x25},{0x60,0x00},{0x27,0x00},{0x50,0x06},{0x51,0x00},{0x52,0x96},
+    {0x56,0x08},{0x57,0x30},{0x61,0x00},{0x62,0x00},{0x64,0x00},{0x65,0x00},
+    {0x66,0xA0},
+    {0xFF,0x01},{0x22,0x32},{0x47,0x14},{0x49,0xFF},{0x4A,0x00},
+    {0xFF,0x00},{0x7A,0x0A},{0x7B,0x00},{0x78,0x21},
+    {0xFF,0x01},{0x23,0x34},{0x42,0x00},{0x44,0xFF},{0x45,0x26},{0x46,0x05},
+    {0x40,0x40},{0x0E,0x06},{0x20,0x1A},{0x43,0x40},
+    {0xFF,0x00},{0x34,0x03},{0x35,0x44},
+    {0xFF,0x01},{0x31,0x04},{0x4B,0x09},{0x4C,0x05},{0x4D,0x04},
+    {0xFF,0x00},{0x44,0x00},{0x45,0x20},{0x47,0x08},{0x48,0x28},{0x67,0x00},
+    {0x70,0x04},{0x71,0x01},{0x72,0xFE},{0x76,0x00},{0x77,0x00},
+    {0xFF,0x01},{0x0D,0x01},
+    {0xFF,0x00},{0x80,0x01},{0x01,0xF8},
+    {0xFF,0x01},{0x8E,0x01},{0x00,0x01},{0xFF,0x00},{0x80,0x00},
+    };
+
+/*
+ * Do the library's full init, then read back what it worked out so that
+ * warmInit() can put it back next time. Changing the VCSEL periods redoes
+ * the phase calibration, so call captureCalibration() again after that.
+ */
+bool CachedVL53L0X::init(bool io_2v8)
+    {
+    _calibration.valid=0;
+    if (!VL53L0X::init(io_2v8))
+        return false;
+    captureCalibration();
+    return true;
+    }
+
+// Read the calibration the sensor is using now, for getCalibration()
+void CachedVL53L0X::captureCalibration()
+    {
+    _calibration.valid=0;
+    writeReg(0x80, 0x01);
+    writeReg(0xFF, 0x01);
+    writeReg(0x00, 0x00);
+    _calibration.stopVariable=readReg(0x91);
+    writeReg(0x00, 0x01);
+    writeReg(0xFF, 0x00);
+    writeReg(0x80, 0x00);
+
+    readMulti(GLOBAL_CONFIG_SPAD_ENABLES_REF_0, _calibration.spadMap, VL53L0X_SPAD_MAP_SIZE);
+
+    _openCalibrationPage();
+    _calibration.vhvSettings=readReg(0xCB);
+    _calibration.phaseCal=readReg(0xEE);
+    _closeCalibrationPage();
+
+    if (last_status==0)
+        _calibration.valid=VL53L0X_CALIBRATION_FLAG;
+    }
+
+/*
+ * The library's init() without the reference SPAD search or the reference
+ * calibrations. Their results come from an earlier init() instead.
+ */
+bool CachedVL53L0X::warmInit(const VL53L0XCalibration& calibration, bool io_2v8)
+    {
+    if (calibration.valid!=VL53L0X_CALIBRATION_FLAG)
+        return false;
+    if (readReg(IDENTIFICATION_MODEL_ID)!=0xEE)
+        return false;
+    _calibration=calibration;
+
+    if (io_2v8)
+        writeReg(VHV_CONFIG_PAD_SCL_SDA__EXTSUP_HV, readReg(VHV_CONFIG_PAD_SCL_SDA__EXTSUP_HV) | 0x01);
+
+    writeReg(0x88, 0x00); //I2C standard mode
+
+    //disable the SIGNAL_RATE_MSRC and SIGNAL_RATE_PRE_RANGE limit checks
+    writeReg(MSRC_CONFIG_CONTROL, readReg(MSRC_CONFIG_CONTROL) | 0x12);
+    setSignalRateLimit(0.25);
+    writeReg(SYSTEM_SEQUENCE_CONFIG, 0xFF);
+
+    //the reference SPADs
+    writeReg(0xFF, 0x01);
+    writeReg(DYNAMIC_SPAD_REF_EN_START_OFFSET, 0x00);
+    writeReg(DYNAMIC_SPAD_NUM_REQUESTED_REF_SPAD, 0x2C);
+    writeReg(0xFF, 0x00);
+    writeReg(GLOBAL_CONFIG_REF_EN_START_SELECT, 0xB4);
+    writeMulti(GLOBAL_CONFIG_SPAD_ENABLES_REF_0, _calibration.spadMap, VL53L0X_SPAD_MAP_SIZE);
+
+    for (size_t i=0;i<sizeof(tuningSettings)/sizeof(tuningSettings[0]);i++)
+        writeReg(tuningSettings[i][0], tuningSettings[i][1]);
+
+    //new sample ready interrupt, active low
+    writeReg(SYSTEM_INTERRUPT_CONFIG_GPIO, 0x04);
+    writeReg(GPIO_HV_MUX_ACTIVE_HIGH, readReg(GPIO_HV_MUX_ACTIVE_HIGH) & ~0x10);
+    writeReg(SYSTEM_INTERRUPT_CLEAR, 0x01);
+
+    //skip the MSRC and TCC steps, and set the timing budget up for that
+    uint32_t budget=getMeasurementTimingBudget();
+    writeReg(SYSTEM_SEQUENCE_CONFIG, 0xE8);
+    setMeasurementTimingBudget(budget);
+
+    //the reference calibration results
+    _openCalibrationPage();
+    writeReg(0xCB, _calibration.vhvSettings);
+    writeReg(0xEE, (readReg(0xEE) & 0x80) | _calibration.phaseCal);
+    _closeCalibrationPage();
+
+    return last_status==0;
+    }
+
+const VL53L0XCalibration& CachedVL53L0X::getCalibration()
+    {
+    return _calibration;
+    }
+
+// The library's startContinuous(), using the saved stop variable
+void CachedVL53L0X::startContinuous(uint32_t period_ms)
+    {
+    _writeStopVariable();
+    if (period_ms!=0)
+        {
+        uint16_t oscCalibrateVal=readReg16Bit(OSC_CALIBRATE_VAL);
+        if (oscCalibrateVal!=0)
+            period_ms*=oscCalibrateVal;
+        writeReg32Bit(SYSTEM_INTERMEASUREMENT_PERIOD, period_ms);
+        writeReg(SYSRANGE_START, 0x04); //timed
+        }
+    else
+        writeReg(SYSRANGE_START, 0x02); //back to back
+    }
+
+/*
+ * Start a single range and return once the sensor has taken it up, without
+ * waiting for the result. Collect it with readRangeContinuousMillimeters().
+ */
+bool CachedVL53L0X::startRangeSingle()
+    {
+    _writeStopVariable();
+    writeReg(SYSRANGE_START, 0x01);
+
+    //wait for the start bit to clear
+    unsigned long start=millis();
+    while (readReg(SYSRANGE_START) & 0x01)
+        {
+        if (getTimeout()>0 && millis()-start>getTimeout())
+            {
+            _timedOut=true;
+            return false;
+            }
+        }
+    return true;
+    }
+
+// The library's readRangeSingleMillimeters(), using the saved stop variable
+uint16_t CachedVL53L0X::readRangeSingleMillimeters()
+    {
+    if (!startRangeSingle())
+        return 65535;
+    return readRangeContinuousMillimeters();
+    }
+
+// Includes timeouts in readRangeSingleMillimeters(), which the library can't see
+bool CachedVL53L0X::timeoutOccurred()
+    {
+    bool timedOut=_timedOut;
+    _timedOut=false;
+    return VL53L0X::timeoutOccurred() || timedOut;
+    }
+
+void CachedVL53L0X::_writeStopVariable()
+    {
+    writeReg(0x80, 0x01);
+    writeReg(0xFF, 0x01);
+    writeReg(0x00, 0x00);
+    writeReg(0x91, _calibration.stopVariable);
+    writeReg(0x00, 0x01);
+    writeReg(0xFF, 0x00);
+    writeReg(0x80, 0x00);
+    }
+
+// The VHV and phase calibration results live behind this
+void CachedVL53L0X::_openCalibrationPage()
+    {
+    writeReg(0xFF, 0x01);
+    writeReg(0x00, 0x00);
+    writeReg(0xFF, 0x00);
+    }
+
+void CachedVL53L0X::_closeCalibrationPage()
+    {
+    writeReg(0xFF, 0x01);
+    writeReg(0x00, 0x01);
+    writeReg(0xFF, 0x00);
+    }
@@ -93,30 +93,128 @@
 
 #include "RYLR998.h"
 
-RYLR998::RYLR998(int rx, int tx) : _serial(rx, tx), _doc(nullptr) 
+// Talk to the module over a bit-banged serial port on any two pins
+RYLR998::RYLR998(int rx, int tx) : _transport(TRANSPORT_SOFTWARE), _softSerial(rx, tx), 
+                                   _hardSerial(nullptr), _serial(&_softSerial), _doc(nullptr) 
     {
     _rxPin=rx;
     _txPin=tx;
+    for (int i=0;i<LORA_COMMAND_QUEUE_SIZE;i++)
+        _slots[i].state=SLOT_FREE;
+    clearNodes();
+    clearStats();
     }
 
-void RYLR998::begin(long baudRate)
+// Talk to the module over a hardware UART, optionally swapped onto GPIO13 (RX) and GPIO15 (TX)
+RYLR998::RYLR998(HardwareSerial& port, bool swap) : _transport(TRANSPORT_HARDWARE), _softSerial(-1, -1), 
+                                                    _hardSerial(&port), _swap(swap), _serial(&port), _doc(nullptr) 
     {
+    _rxPin=-1;
+    _txPin=-1;
+    for (int i=0;i<LORA_COMMAND_QUEUE_SIZE;i++)
+        _slots[i].state=SLOT_FREE;
+    clearNodes();
+    clearStats();
+    }
+
+// Talk to the module over a stream that is already set up, such as a test double.
+// begin() can't change its baud rate, so it just checks that something answers.
+RYLR998::RYLR998(Stream& stream) : _transport(TRANSPORT_STREAM), _softSerial(-1, -1), 
+                                   _hardSerial(nullptr), _serial(&stream), _doc(nullptr) 
+    {
+    _rxPin=-1;
+    _txPin=-1;
+    for (int i=0;i<LORA_COMMAND_QUEUE_SIZE;i++)
+        _slots[i].state=SLOT_FREE;
+    clearNodes();
+    clearStats();
+    }
+
+/*
+ * Open the link to the module and make sure it answers. The requested rate
+ * is tried first, then every rate the RYLR998 supports, until something
+ * answers or the time runs out. Returns false if the module never answered
+ * so the caller can give up for this wake instead of waiting forever.
+ */
+bool RYLR998::begin(long baudRate, unsigned long timeout)
+    {
+    static const long rates[]={115200, 57600, 38400, 28800, 19200, 9600, 4800, 2400, 1200, 300};
+    const int rateCount=sizeof(rates)/sizeof(rates[0]);
+    unsigned long start=millis();
+    _detectedBaudRate=0;
+
+    //Any reply at all means the rate is right. Every rate gets one probe
+    //before any gets a second, so they are all tried within the timeout.
+    //The first command after power-up can go unanswered, so if there's
+    //time left go round again.
+    for (int pass=0;pass<2 && !_detectedBaudRate && millis()-start<timeout;pass++)
+        {
+        for (int i=-1;i<rateCount && millis()-start<timeout;i++)
+            {
+            long rate=i<0?baudRate:rates[i];
+            if (i>=0 && rate==baudRate)
+                continue; //already tried it
+            if (i>=0 && _transport==TRANSPORT_STREAM)
+                break;    //nothing to change on a plain stream
+
+            _openSerial(rate);
+            char response[LORA_RESPONSE_SIZE];
+            _sendCommand("AT", response, sizeof(response), LORA_PROBE_TIMEOUT);
+            if (response[0]=='+')
+                {
+                _detectedBaudRate=rate;
+                break;
+                }
+            Serial.print(".");
+            }
+        }
+
+    _discoveryTime=millis()-start;
     if (_debug)
-        Serial.println("LORA:Setting softwareSerial baud rate to "+String(baudRate));
-    _serial.begin(baudRate, SWSERIAL_8N1, _rxPin, _txPin, false, 120,1200);
+        {
+        if (_detectedBaudRate)
+            Serial.println("LORA:Module answered at "+String(_detectedBaudRate)+" baud after "+String(_discoveryTime)+"ms");
+        else
+            Serial.println("LORA:No answer from module after "+String(_discoveryTime)+"ms");
+        }
+    return _detectedBaudRate!=0;
+    }
+
+long RYLR998::getDetectedBaudRate()
+    {
+    return _detectedBaudRate;
+    }
+
+unsigned long RYLR998::getDiscoveryTime()
+    {
+    return _discoveryTime;
+    }
+
+void RYLR998::_openSerial(long baudRate)
+    {
+    if (_transport==TRANSPORT_SOFTWARE)
+        {
+        if (_debug)
+            Serial.println("LORA:Setting softwareSerial baud rate to "+String(baudRate));
+        _softSerial.end();
+        _softSerial.begin(baudRate, SWSERIAL_8N1, _rxPin, _txPin, false, 120,1200);
+        }
+    else if (_transport==TRANSPORT_HARDWARE)
+        {
+        if (_debug)
+            Serial.println("LORA:Setting hardware serial baud rate to "+String(baudRate));
+        _hardSerial->begin(baudRate);
+        if (_swap)
+            _hardSerial->swap(); //begin() puts the pins back, so swap every time
+        }
     
     //clear out any lingering buffer contents
-    _serial.flush();
-    while(_serial.available())
-      {
-      _serial.read(); 
-      }
-
-    while(!testComm())
+    _serial->flush();
+    while(_serial->available())
       {
-      Serial.print(".");
-      // keep trying until it works
+      _serial->read(); 
       }
+    _rxHead=_rxTail=_rxLines=0;
     }
 
 void RYLR998::setJsonDocument(StaticJsonDocument<250> &doc)
@@ -126,127 +224,626 @@ void RYLR998::setJsonDocument(StaticJsonDocument<250> &doc)
 
 bool RYLR998::handleIncoming()
     {
-    bool ok=false;
-    if (_serial.available())
+    service();
+    if (!_rcvPending)
+        return false;
+    _rcvPending=false;
+
+    RcvFrame frame;
+    bool decoded;
+    if (!_acceptFrame(_rcvLine, frame, _lastReport, decoded, _duplicate))
+        return false;
+
+    if (!_doc)
+        return false;
+    //A node whose ack got lost sends the same report again. Skip the JSON
+    //work and only say who sent it, so the caller can ack it again without
+    //publishing it twice.
+    if (_duplicate)
+        {
+        _doc->clear();
+        (*_doc)["address"]=frame.address;
+        (*_doc)["seq"]=_lastReport.sequence;
+        (*_doc)["dup"]=true;
+        return true;
+        }
+    expandFrame(frame, decoded?&_lastReport:nullptr, *_doc);
+    return true;
+    }
+
+/*
+ * Parse an +RCV line, decode it if it is a binary report, and check it
+ * against the sender's last sequence number. Returns false if the line
+ * doesn't parse. The frame's payload points into the line.
+ */
+bool RYLR998::_acceptFrame(const char* line, RcvFrame& frame, ReportFrame& report, bool& decoded, bool& duplicate)
+    {
+    if (_debug)
+        {
+        Serial.print("LORA:Received from LoRa:");
+        Serial.println(line);
+        }
+
+    decoded=false;
+    duplicate=false;
+    if (!parseRcv(line, frame))
+        return false;
+
+    _lastAddress=frame.address;
+    if (_debug)
+        {
+        Serial.print("Address: ");
+        Serial.println(frame.address);
+        Serial.print("Length: ");
+        Serial.println(frame.length);
+        Serial.print("Json Data:");
+        Serial.write((const uint8_t*)frame.payload, frame.payloadLen);
+        Serial.println();
+        Serial.print("Rssi: ");
+        Serial.println(frame.rssi);
+        Serial.print("SNR: ");
+        Serial.println(frame.snr);
+        }
+
+    bool isReport=frame.payloadLen>0 && frame.payload[0]==LORA_FRAME_MARKER;
+    decoded=isReport && decodeReport(frame.payload, frame.payloadLen, report);
+
+    bool repeat=_trackNode(frame, decoded?&report:nullptr);
+    if (repeat && _filterDuplicates)
         {
-        String response = _serial.readStringUntil('\n');
-        
         if (_debug)
-            Serial.println("LORA:Received from LoRa:"+response);
+            Serial.println("LORA:Dropping repeated report "+String(report.sequence)+" from "+String(frame.address));
+        duplicate=true;
+        _duplicates++;
+        }
+    return true;
+    }
 
-        if (response.startsWith("+RCV="))
+/*
+ * Fill a document from a received frame. A binary report (pass its decoded
+ * form, or nullptr if it didn't decode) is expanded into the same JSON a node
+ * used to send; anything else is parsed as JSON. The address, length, rssi
+ * and snr are added either way.
+ */
+void RYLR998::expandFrame(const RcvFrame& frame, const ReportFrame* report, StaticJsonDocument<250>& doc)
+    {
+    doc.clear();
+    if (frame.payloadLen>0 && frame.payload[0]==LORA_FRAME_MARKER)
+        {
+        if (report)
             {
-            int equalSignIndex = response.indexOf('=');
-            String result = response.substring(equalSignIndex + 1);
+            if (report->distance==LORA_DISTANCE_INVALID)
+                doc["distance"]=-1;
+            else
+                doc["distance"]=report->distance;
+            doc["battery"]=report->batteryMv/1000.0;
+            doc["isPresent"]=(report->flags & LORA_FLAG_PRESENT)!=0;
+            doc["seq"]=report->sequence;
+            if (report->readingCount)
+                doc["readings"]=report->readingCount; //too many for the document, see getLastReport()
+            }
+        else
+            Serial.println(F("LORA:Could not decode report frame"));
+        }
+    else
+        {
+        DeserializationError error = deserializeJson(doc, frame.payload, frame.payloadLen);
+        if (error)
+            {
+            Serial.print(F("LORA:deserializeJson() failed. Error is: "));
+            Serial.println(error.c_str());
+            }
+        }
 
-            String address, length, jsonData, rssi, snr;
-            _parseRcvString(result, address, length, jsonData, rssi, snr);
+    //These are the standard data that go with all messages
+    doc["address"]=frame.address;
+    doc["length"]=frame.length;
+    doc["rssi"]=frame.rssi;
+    doc["snr"]=frame.snr;
+    }
 
-            if (_debug)
-                {
-                Serial.print("Address: ");
-                Serial.println(address);
-                Serial.print("Length: ");
-                Serial.println(length);
-                Serial.print("Json Data:");
-                Serial.println(jsonData);
-                Serial.print("Rssi: ");
-                Serial.println(rssi);
-                Serial.print("SNR: ");
-                Serial.println(snr);
-                }
+/*
+ * In drain mode every +RCV line is decoded into a queue as soon as it is
+ * read, instead of waiting in a single slot for handleIncoming(), so a burst
+ * of frames is not lost while the application is busy. Collect them with
+ * drain() and readFrame(). handleIncoming() sees nothing while this is on.
+ */
+void RYLR998::setDrainMode(bool enabled)
+    {
+    _drainMode=enabled;
+    if (enabled && _rcvPending)
+        {
+        _rcvPending=false;
+        _queueFrame(_rcvLine);
+        }
+    }
 
-            if (_doc && jsonData)
-                {
-                DeserializationError error = deserializeJson(*_doc, jsonData);
-                if (error)
-                    {
-                    Serial.print(F("LORA:deserializeJson() failed. Error is: "));
-                    Serial.println(error.c_str());
-                    }
-                //These are the standard data that go with all messages
-                (*_doc)["address"]=atoi(address.c_str());
-                (*_doc)["length"]=atoi(length.c_str());
-                (*_doc)["rssi"]=atoi(rssi.c_str());
-                (*_doc)["snr"]=atoi(snr.c_str());
-                ok=true;
-                }
-            }
+// Read everything the module has sent so far. Returns the number of frames waiting in the queue.
+int RYLR998::drain()
+    {
+    service();
+    return _rxQueueCount-(_rxFrameHeld?1:0);
+    }
+
+/*
+ * Take the oldest frame off the queue, or nullptr if it is empty. The frame
+ * keeps its slot until the next readFrame() call, so it stays valid while the
+ * caller sends or services the module. Its payload points into its own line,
+ * so use it through the pointer rather than copying it.
+ */
+const ReceivedFrame* RYLR998::readFrame()
+    {
+    if (_rxFrameHeld)
+        {
+        _rxQueueHead=(_rxQueueHead+1)%LORA_RX_QUEUE_DEPTH;
+        _rxQueueCount--;
+        _rxFrameHeld=false;
         }
-    return ok;
+    if (_rxQueueCount==0)
+        return nullptr;
+    _rxFrameHeld=true;
+    return &_rxQueue[_rxQueueHead];
+    }
+
+// Frames lost because the queue was full when they arrived
+uint32_t RYLR998::getDroppedFrames()
+    {
+    return _droppedFrames;
+    }
+
+void RYLR998::_queueFrame(const char* line)
+    {
+    if (_rxQueueCount==LORA_RX_QUEUE_DEPTH)
+        {
+        if (_debug)
+            Serial.println(F("LORA:Receive queue full, dropping frame"));
+        _droppedFrames++;
+        return;
+        }
+    ReceivedFrame& received=_rxQueue[(_rxQueueHead+_rxQueueCount)%LORA_RX_QUEUE_DEPTH];
+    strcpy(received.line,line);
+    if (_acceptFrame(received.line, received.frame, received.report, received.decoded, received.duplicate))
+        _rxQueueCount++;
+    }
+
+/*
+ * Wait until a frame arrives and handleIncoming() accepts it, or until the
+ * timeout runs out. Returns as soon as the frame is in the document, so a node
+ * waiting for an ack doesn't sit out a fixed delay after the ack has arrived.
+ * Repeats and frames that don't parse are skipped and the wait goes on.
+ */
+bool RYLR998::waitForFrame(unsigned long timeout)
+    {
+    unsigned long start=millis();
+    do
+        {
+        service();
+        if (_rcvPending && handleIncoming())
+            return true;
+        yield();
+        } while (millis()-start<timeout);
+    return false;
+    }
+
+/*
+ * Listen before talking. The RYLR998 has no channel activity detection, so
+ * this listens for listenTime ms and reports the channel busy if a frame
+ * came in meanwhile. Make the window at least one frame's time on air.
+ * Frames heard are kept for handleIncoming() or the drain queue as usual.
+ *
+ * The module only passes on frames addressed to this node or to broadcast
+ * address 0 (and only on our network ID), so this does NOT hear other nodes
+ * reporting to the gateway. It catches the gateway's acks and broadcasts
+ * and not much else; it is no protection against two nodes colliding.
+ */
+bool RYLR998::channelClear(unsigned long listenTime)
+    {
+    uint32_t heard=_framesHeard;
+    unsigned long start=millis();
+    do
+        {
+        service();
+        yield();
+        } while (millis()-start<listenTime);
+    return _framesHeard==heard;
+    }
+
+/*
+ * Drive the command engine. This never blocks: it reads whatever bytes the
+ * module has sent, completes the active command when its reply (or its timeout)
+ * arrives, and starts the next queued command when the module is idle.
+ * Call it often, from loop() or any wait loop.
+ */
+void RYLR998::service()
+    {
+    while (_readLine())
+        _dispatchLine();
+
+    if (_active>=0 && millis()-_slots[_active].started >= _slots[_active].timeout)
+        {
+        if (_debug)
+            Serial.println("LORA:Timed out waiting for reply to "+String(_slots[_active].command));
+        _complete(_active, true);
+        }
+
+    if (_active<0)
+        _startNext();
+    }
+
+/*
+ * Queue an AT command. Returns a handle that can be polled with isComplete(),
+ * or -1 if the queue is full or the command is too long. If a callback is given
+ * it is called on completion and the slot is released automatically; otherwise
+ * the caller must release() the handle after reading the response.
+ */
+int RYLR998::queueCommand(const char* command, LoraCallback callback, unsigned long timeout)
+    {
+    if (strlen(command) >= LORA_COMMAND_SIZE)
+        return -1;
+    return _queue(command, nullptr, 0, callback, timeout);
+    }
+
+/*
+ * Queue an AT+SEND of a payload and return at once, with a handle to poll
+ * like queueCommand()'s. The payload is written straight from the caller's
+ * buffer when its turn comes, so it must stay put until the handle completes.
+ * Unlike send(), nothing is retried; see getResult() for how it went.
+ */
+int RYLR998::queueSend(uint16_t address, const uint8_t* data, size_t len, unsigned long timeout)
+    {
+    char header[24];
+    snprintf(header, sizeof(header), "AT+SEND=%u,%u,", address, (unsigned int)len);
+    return _queue(header, data, len, nullptr, timeout);
+    }
+
+bool RYLR998::isComplete(int handle)
+    {
+    return handle>=0 && handle<LORA_COMMAND_QUEUE_SIZE && _slots[handle].state==SLOT_DONE;
+    }
+
+bool RYLR998::isTimedOut(int handle)
+    {
+    return isComplete(handle) && _slots[handle].timedOut;
+    }
+
+const char* RYLR998::getResponse(int handle)
+    {
+    return isComplete(handle)?_slots[handle].response:"";
+    }
+
+// What a completed command's reply means: LORA_OK, a timeout, or the module's +ERR code
+LoraResult RYLR998::getResult(int handle)
+    {
+    if (handle<0)
+        return LORA_QUEUE_FULL;
+    if (isTimedOut(handle))
+        return LORA_TIMEOUT;
+    const char* response=getResponse(handle);
+    if (strncmp(response,"+ERR=",5)==0)
+        return (LoraResult)atoi(response+5);
+    if (response[0]=='+')
+        return LORA_OK; //+OK, or the answer to a query
+    return LORA_UNEXPECTED;
+    }
+
+void RYLR998::release(int handle)
+    {
+    if (handle>=0 && handle<LORA_COMMAND_QUEUE_SIZE && _slots[handle].state!=SLOT_ACTIVE)
+        _slots[handle].state=SLOT_FREE;
+    }
+
+// True if a command is in flight or waiting to be sent
+bool RYLR998::isBusy()
+    {
+    if (_active>=0)
+        return true;
+    for (int i=0;i<LORA_COMMAND_QUEUE_SIZE;i++)
+        {
+        if (_slots[i].state==SLOT_QUEUED)
+            return true;
+        }
+    return false;
     }
 
 bool RYLR998::send(uint16_t address, const String &data)
     {
-    String command = "AT+SEND=" + 
-                        String(address) + "," + 
-                        String(data.length()) + "," + 
-                        data;
-    String response = _sendCommand(command);
-    if (response != "+OK")
-        Serial.println("LORA:Response from RYLR998: "+response);
-        
-    return response == "+OK";
+    return send(address, (const uint8_t*)data.c_str(), data.length());
+    }
+
+/*
+ * Send a payload straight from the caller's buffer. Only the short
+ * "AT+SEND=<address>,<length>," header is formatted, on the stack; the data
+ * itself goes to the UART as is.
+ */
+bool RYLR998::send(uint16_t address, const uint8_t* data, size_t len)
+    {
+    char header[24];
+    char response[LORA_RESPONSE_SIZE];
+    snprintf(header, sizeof(header), "AT+SEND=%u,%u,", address, (unsigned int)len);
+
+    //a send that timed out may well have gone out, so it isn't sent again
+    unsigned long start=millis();
+    for (int attempt=1;;attempt++)
+        {
+        int handle=_startRaw(header, data, len, _attemptTimeout(LORA_DEFAULT_TIMEOUT, start));
+        _lastResult=_await(handle, response, sizeof(response));
+        if (!_retry(_lastResult, attempt, start, false))
+            break;
+        }
+    if (_lastResult!=LORA_OK)
+        {
+        Serial.print("LORA:Send failed with result ");
+        Serial.print(_lastResult);
+        Serial.print(", response from RYLR998: ");
+        Serial.println(response);
+        return false;
+        }
+    return true;
     }
 
 bool RYLR998::setMode(uint8_t mode, uint16_t rxTime, uint16_t lowSpeedTime)
     {
-    String command = "AT+MODE=" + String(mode);
+    char command[LORA_COMMAND_SIZE];
     if (mode == 2)
-    {
-        command += "," + String(rxTime) + "," + String(lowSpeedTime);
-    }
-    String response = _sendCommand(command);
-    return response == "+OK";
+        snprintf(command, sizeof(command), "AT+MODE=%u,%u,%u", mode, rxTime, lowSpeedTime);
+    else
+        snprintf(command, sizeof(command), "AT+MODE=%u", mode);
+    if (!_setCommand(command))
+        return false;
+    strncpy(_shadow.mode, command+8, sizeof(_shadow.mode)-1); //what follows "AT+MODE="
+    _shadow.mode[sizeof(_shadow.mode)-1]='\0';
+    return true;
     }   
 
 bool RYLR998::setBand(uint32_t frequency)
     {
-    String command = "AT+BAND=" + String(frequency);
-    String response = _sendCommand(command);
-    return response == "+OK";
+    char command[LORA_COMMAND_SIZE];
+    snprintf(command, sizeof(command), "AT+BAND=%lu", (unsigned long)frequency);
+    if (!_setCommand(command))
+        return false;
+    _shadow.config.band=frequency;
+    return true;
     }
 
 bool RYLR998::setParameter(uint8_t sf, uint8_t bw, uint8_t cr, uint8_t preamble)
     {
-    String command = "AT+PARAMETER=" + String(sf) + "," + String(bw) + "," + String(cr) + "," + String(preamble);
-    String response = _sendCommand(command);
-    return response == "+OK";
+    char command[LORA_COMMAND_SIZE];
+    snprintf(command, sizeof(command), "AT+PARAMETER=%u,%u,%u,%u", sf, bw, cr, preamble);
+    if (!_setCommand(command))
+        return false;
+    _shadow.config.spreadingFactor=sf;
+    _shadow.config.bandwidth=bw;
+    _shadow.config.codingRate=cr;
+    _shadow.config.preamble=preamble;
+    return true;
     }
 
 bool RYLR998::setAddress(uint16_t address)
     {
-    String command = "AT+ADDRESS=" + String(address);
-    String response = _sendCommand(command);
-    return response == "+OK";
+    char command[LORA_COMMAND_SIZE];
+    snprintf(command, sizeof(command), "AT+ADDRESS=%u", address);
+    if (!_setCommand(command))
+        return false;
+    _shadow.config.address=address;
+    return true;
     }   
 
 bool RYLR998::setNetworkID(uint8_t id)
     {
-    String command = "AT+NETWORKID=" + String(id);
-    String response = _sendCommand(command);
-    return response == "+OK";
+    char command[LORA_COMMAND_SIZE];
+    snprintf(command, sizeof(command), "AT+NETWORKID=%u", id);
+    if (!_setCommand(command))
+        return false;
+    _shadow.config.networkID=id;
+    return true;
     }
 
 bool RYLR998::setCPIN(const String &password)
     {
-    String command = "AT+CPIN=" + password;
-    String response = _sendCommand(command);
-    return response == "+OK";
+    char command[LORA_COMMAND_SIZE];
+    snprintf(command, sizeof(command), "AT+CPIN=%s", password.c_str());
+    if (!_setCommand(command))
+        return false;
+    strncpy(_shadow.config.cpin, password.c_str(), sizeof(_shadow.config.cpin)-1);
+    _shadow.config.cpin[sizeof(_shadow.config.cpin)-1]='\0';
+    return true;
     }
 
 bool RYLR998::setRFPower(uint8_t power)
     {
-    String command = "AT+CRFOP=" + String(power);
-    String response = _sendCommand(command);
-    return response == "+OK";
+    char command[LORA_COMMAND_SIZE];
+    snprintf(command, sizeof(command), "AT+CRFOP=%u", power);
+    if (!_setCommand(command))
+        return false;
+    _shadow.config.power=power;
+    return true;
     }
 
 bool RYLR998::setBaudRate(uint32_t baudrate)
     {
-    String command = "AT+IPR=" + String(baudrate);
-    String response = _sendCommand(command);
-    return response == "+OK";
+    char command[LORA_COMMAND_SIZE];
+    snprintf(command, sizeof(command), "AT+IPR=%lu", (unsigned long)baudrate);
+    if (!_setCommand(command))
+        return false;
+    _shadow.baudRate=baudrate;
+    return true;
+    }
+
+/*
+ * Bring the module in line with config, writing only the settings that differ
+ * from what it already holds. Every write costs a round trip and a write to the
+ * module's flash, so on a normal boot this sends nothing but the queries.
+ */
+bool RYLR998::applyConfig(const RadioConfig& config)
+    {
+    //if the query fails, everything looks different and gets written, unless
+    //nothing answered at all: then the module is off and writing would only wait
+    if (!_shadowValid && !queryAll() && _lastResult==LORA_TIMEOUT)
+        {
+        if (_debug)
+            Serial.println("LORA:Module not answering, configuration not applied");
+        return false;
+        }
+
+    bool ok=true;
+    if (!_shadowValid || _shadow.config.address!=config.address)
+        ok&=setAddress(config.address);
+    if (!_shadowValid || _shadow.config.networkID!=config.networkID)
+        ok&=setNetworkID(config.networkID);
+    if (!_shadowValid || _shadow.config.band!=config.band)
+        ok&=setBand(config.band);
+    if (!_shadowValid
+        || _shadow.config.spreadingFactor!=config.spreadingFactor
+        || _shadow.config.bandwidth!=config.bandwidth
+        || _shadow.config.codingRate!=config.codingRate
+        || _shadow.config.preamble!=config.preamble)
+        ok&=setParameter(config.spreadingFactor, config.bandwidth, config.codingRate, config.preamble);
+    if (config.cpin[0] && (!_shadowValid || strcmp(_shadow.config.cpin, config.cpin)!=0))
+        ok&=setCPIN(config.cpin);
+    if (!_shadowValid || _shadow.config.power!=config.power)
+        ok&=setRFPower(config.power);
+
+    if (_debug)
+        Serial.println(ok?"LORA:Configuration applied":"LORA:Configuration failed");
+    return ok;
+    }
+
+/*
+ * Read every setting back from the module in one go. The queries are written
+ * back to back and the replies matched up by their prefix as they arrive, so
+ * this costs about one round trip instead of eight. Anything the module didn't
+ * answer is asked again on its own. If nothing answers at all, nothing is
+ * asked again and getLastResult() says LORA_TIMEOUT.
+ */
+bool RYLR998::queryAll(unsigned long timeout)
+    {
+    static const char* const queries[]={"AT+ADDRESS?","AT+NETWORKID?","AT+BAND?","AT+IPR?",
+                                        "AT+MODE?","AT+PARAMETER?","AT+CPIN?","AT+CRFOP?"};
+    const int queryCount=sizeof(queries)/sizeof(queries[0]);
+    const uint8_t allFields=0xFF;
+    uint8_t answered=0;
+    int replies=0;
+    _shadowValid=false;
+
+    //let anything already queued finish so its reply isn't taken for one of ours
+    while (isBusy())
+        {
+        service();
+        yield();
+        }
+
+    if (_debug)
+        Serial.println("LORA:Querying all settings");
+    for (int i=0;i<queryCount;i++)
+        _serial->println(queries[i]);
+
+    unsigned long start=millis();
+    while (answered!=allFields && replies<queryCount && millis()-start<timeout)
+        {
+        if (_readLine())
+            {
+            if (strncmp(_line,"+RCV=",5)==0)
+                _dispatchLine();
+            else if (_line[0])
+                {
+                if (_debug)
+                    Serial.println("LORA:"+String(_line));
+                answered|=_parseQueryReply(_line);
+                replies++;
+                _record("AT+?", millis()-start, false, _line);
+                }
+            }
+        else
+            yield();
+        }
+
+    _lastResult=replies?LORA_OK:LORA_TIMEOUT;
+    if (!replies)
+        return false;
+
+    for (int i=0;i<queryCount;i++)
+        {
+        if (!(answered & (1<<i)))
+            {
+            char response[LORA_RESPONSE_SIZE];
+            if (_execute(queries[i], response, sizeof(response))==LORA_OK)
+                answered|=_parseQueryReply(response);
+            }
+        }
+
+    _shadowValid=(answered==allFields);
+    return _shadowValid;
+    }
+
+// The settings as last read or written. Only meaningful after a successful queryAll().
+const RadioState& RYLR998::getState()
+    {
+    return _shadow;
+    }
+
+// Store one query reply in the shadow. Returns the QueryField it filled, or 0.
+uint8_t RYLR998::_parseQueryReply(const char* line)
+    {
+    const char* value=strchr(line,'=');
+    if (value==nullptr)
+        return 0;
+    value++;
+
+    if (strncmp(line,"+ADDRESS=",9)==0)
+        {
+        _shadow.config.address=atoi(value);
+        return QUERY_ADDRESS;
+        }
+    if (strncmp(line,"+NETWORKID=",11)==0)
+        {
+        _shadow.config.networkID=atoi(value);
+        return QUERY_NETWORKID;
+        }
+    if (strncmp(line,"+BAND=",6)==0)
+        {
+        _shadow.config.band=strtoul(value, nullptr, 10);
+        return QUERY_BAND;
+        }
+    if (strncmp(line,"+IPR=",5)==0)
+        {
+        _shadow.baudRate=strtoul(value, nullptr, 10);
+        return QUERY_IPR;
+        }
+    if (strncmp(line,"+MODE=",6)==0)
+        {
+        strncpy(_shadow.mode, value, sizeof(_shadow.mode)-1);
+        _shadow.mode[sizeof(_shadow.mode)-1]='\0';
+        return QUERY_MODE;
+        }
+    if (strncmp(line,"+PARAMETER=",11)==0)
+        {
+        int sf, bw, cr, preamble;
+        if (sscanf(value, "%d,%d,%d,%d", &sf, &bw, &cr, &preamble)!=4)
+            return 0;
+        _shadow.config.spreadingFactor=sf;
+        _shadow.config.bandwidth=bw;
+        _shadow.config.codingRate=cr;
+        _shadow.config.preamble=preamble;
+        return QUERY_PARAMETER;
+        }
+    if (strncmp(line,"+CPIN=",6)==0)
+        {
+        strncpy(_shadow.config.cpin, value, sizeof(_shadow.config.cpin)-1); //"No Password!" won't match a real one
+        _shadow.config.cpin[sizeof(_shadow.config.cpin)-1]='\0';
+        return QUERY_CPIN;
+        }
+    if (strncmp(line,"+CRFOP=",7)==0)
+        {
+        _shadow.config.power=atoi(value);
+        return QUERY_CRFOP;
+        }
+    return 0;
+    }
+
+// Forget what we know about the module, e.g. after it has been reset
+void RYLR998::invalidateShadow()
+    {
+    _shadowValid=false;
     }
 
 bool RYLR998::setdebug(bool debugMode)
@@ -255,111 +852,896 @@ bool RYLR998::setdebug(bool debugMode)
     return true;
     }
 
+// The getters answer from the shadow, reading the module only when it's stale
 String RYLR998::getMode()
     {
-    String response=_sendCommand("AT+MODE?");
-    int equalSignIndex = response.indexOf('=');
-    return response.substring(equalSignIndex + 1);
+    if (!_shadowValid && !queryAll())
+        return "";
+    return _shadow.mode;
     }  
      
 String RYLR998::getBand()
     {
-    String response= _sendCommand("AT+BAND?");
-    int equalSignIndex = response.indexOf('=');
-    return response.substring(equalSignIndex + 1);
+    if (!_shadowValid && !queryAll())
+        return "";
+    return String(_shadow.config.band);
     }
 
 String RYLR998::getParameter()
     {
-    String response= _sendCommand("AT+PARAMETER?");
-    int equalSignIndex = response.indexOf('=');
-    return response.substring(equalSignIndex + 1);
+    if (!_shadowValid && !queryAll())
+        return "";
+    char parameter[16];
+    snprintf(parameter, sizeof(parameter), "%u,%u,%u,%u",
+             _shadow.config.spreadingFactor, _shadow.config.bandwidth,
+             _shadow.config.codingRate, _shadow.config.preamble);
+    return parameter;
     }
 
 String RYLR998::getAddress()
     {
-    String response= _sendCommand("AT+ADDRESS?");
-    int equalSignIndex = response.indexOf('=');
-    return response.substring(equalSignIndex + 1);
+    if (!_shadowValid && !queryAll())
+        return "";
+    return String(_shadow.config.address);
     }   
 
 String RYLR998::getNetworkID()
     {
-    String response= _sendCommand("AT+NETWORKID?");
-    int equalSignIndex = response.indexOf('=');
-    return response.substring(equalSignIndex + 1);
+    if (!_shadowValid && !queryAll())
+        return "";
+    return String(_shadow.config.networkID);
     }
 
 String RYLR998::getCPIN()
     {
-    String response= _sendCommand("AT+CPIN?");
-    int equalSignIndex = response.indexOf('=');
-    return response.substring(equalSignIndex + 1);
+    if (!_shadowValid && !queryAll())
+        return "";
+    return _shadow.config.cpin;
     }
 
 String RYLR998::getRFPower()
     {
-    String response= _sendCommand("AT+CRFOP?");
-    int equalSignIndex = response.indexOf('=');
-    return response.substring(equalSignIndex + 1);
+    if (!_shadowValid && !queryAll())
+        return "";
+    return String(_shadow.config.power);
     }
 
 String RYLR998::getBaudRate()
     {
-    String response= _sendCommand("AT+IPR?");
-    int equalSignIndex = response.indexOf('=');
-    return response.substring(equalSignIndex + 1);
+    if (!_shadowValid && !queryAll())
+        return "";
+    return String(_shadow.baudRate);
     }
 
 bool RYLR998::testComm()
     {
-    String command = "AT";
-    String response = _sendCommand(command);
-    return response == "+OK";
+    char response[LORA_RESPONSE_SIZE];
+    _lastResult=_execute("AT", response, sizeof(response));
+    return _lastResult==LORA_OK;
+    }
+
+// The typed outcome of the last setter, send, testComm or queryAll
+LoraResult RYLR998::getLastResult()
+    {
+    return _lastResult;
+    }
+
+/*
+ * Blocking wrapper around the command engine, for callers that need the answer
+ * right away. Other queued commands and incoming frames are still serviced
+ * while we wait.
+ */
+LoraResult RYLR998::_sendCommand(const char* command, char* response, size_t size, unsigned long timeout)
+    {
+    int handle=queueCommand(command, nullptr, timeout);
+    if (handle<0)
+        {
+        Serial.print("LORA:Command queue full, dropping ");
+        Serial.println(command);
+        }
+    return _await(handle, response, size);
     }
 
+// Like _sendCommand, but retries according to what went wrong
+LoraResult RYLR998::_execute(const char* command, char* response, size_t size, unsigned long timeout)
+    {
+    LoraResult result;
+    unsigned long start=millis();
+    for (int attempt=1;;attempt++)
+        {
+        result=_sendCommand(command, response, size, _attemptTimeout(timeout, start));
+        if (!_retry(result, attempt, start, true))
+            break;
+        }
+    return result;
+    }
 
-String RYLR998::_sendCommand(const String &command, unsigned long timeout)
+// An attempt's timeout, cut short so the whole call stays within LORA_MAX_CALL_TIME
+unsigned long RYLR998::_attemptTimeout(unsigned long timeout, unsigned long start)
     {
+    unsigned long elapsed=millis()-start;
+    if (elapsed>=LORA_MAX_CALL_TIME)
+        return 0;
+    return min(timeout, LORA_MAX_CALL_TIME-elapsed);
+    }
+
+// Send a setting. A failure means we no longer know what the module holds.
+bool RYLR998::_setCommand(const char* command)
+    {
+    char response[LORA_RESPONSE_SIZE];
+    _lastResult=_execute(command, response, sizeof(response));
+    if (_lastResult!=LORA_OK)
+        _shadowValid=false;
+    return _lastResult==LORA_OK;
+    }
+
+/*
+ * The retry policy. Decide from the kind of failure whether trying again can
+ * help, and do whatever needs doing first. Returns true to try again.
+ * A silent module is usually an unpowered one, so a timeout is tried again
+ * only once. It isn't tried again at all when resend is false: a send whose
+ * reply was lost has probably gone out already. No retry starts once a call
+ * has used LORA_MAX_CALL_TIME.
+ */
+bool RYLR998::_retry(LoraResult result, int attempt, unsigned long start, bool resend)
+    {
+    if (result==LORA_OK || attempt>=LORA_MAX_ATTEMPTS || millis()-start>=LORA_MAX_CALL_TIME)
+        return false;
+    if (result==LORA_TIMEOUT && (!resend || attempt>1))
+        return false;
+
     if (_debug)
-        Serial.println("LORA:Sending lora command:"+command);
+        Serial.println("LORA:Command failed with result "+String(result)+", attempt "+String(attempt));
 
-    yield();
-    _serial.println(command);
-    unsigned long start = millis();
-    String response = "";
-    while (millis() - start < timeout)
-      {
-      if (_serial.available())
+    switch (result)
+        {
+        case LORA_ERR_TX_BUSY:  //the last transmission is still on the air, give it time to finish
+            _pause(LORA_TX_BUSY_WAIT*attempt);
+            return true;
+
+        case LORA_ERR_NO_CRLF:  //the module lost track of where our lines start and end
+        case LORA_ERR_NOT_AT:
+        case LORA_UNEXPECTED:
+        case LORA_TIMEOUT:
+            _resync();
+            return true;
+
+        case LORA_QUEUE_FULL:
+            _pause(LORA_RESYNC_WAIT);
+            return true;
+
+        default:                //the module understood and said no, asking again won't change that
+            return false;
+        }
+    }
+
+/*
+ * Get back in step with the module: end whatever partial line it may be
+ * holding, then throw away its complaint and any other stray replies.
+ */
+void RYLR998::_resync()
+    {
+    while (isBusy())
+        {
+        service();
+        yield();
+        }
+    if (_debug)
+        Serial.println("LORA:Resyncing with module");
+
+    _serial->write((const uint8_t*)"\r\n", 2);
+    unsigned long start=millis();
+    while (millis()-start<LORA_RESYNC_WAIT)
+        {
+        if (_readLine())
+            {
+            if (strncmp(_line,"+RCV=",5)==0)
+                _dispatchLine();
+            }
+        else
+            yield();
+        }
+    }
+
+// Wait, but keep the engine and incoming frames moving
+void RYLR998::_pause(unsigned long ms)
+    {
+    unsigned long start=millis();
+    while (millis()-start<ms)
+        {
+        service();
+        yield();
+        }
+    }
+
+/*
+ * Wait for a command to complete and copy out its reply, releasing the handle.
+ */
+LoraResult RYLR998::_await(int handle, char* response, size_t size)
+    {
+    response[0]='\0';
+    if (handle<0)
+        return LORA_QUEUE_FULL;
+    while (!isComplete(handle))
+        {
+        service();
+        yield();
+        }
+    LoraResult result=getResult(handle);
+    strncpy(response, getResponse(handle), size-1);
+    response[size-1]='\0';
+    release(handle);
+    return result;
+    }
+
+/*
+ * Start an AT+SEND for send(), once anything already queued has finished.
+ * The payload goes out straight from the caller's buffer and the engine
+ * collects the reply as usual.
+ */
+int RYLR998::_startRaw(const char* header, const uint8_t* data, size_t len, unsigned long timeout)
+    {
+    while (isBusy())
+        {
+        service();
+        yield();
+        }
+
+    int handle=_queue(header, data, len, nullptr, timeout);
+    if (handle<0)
+        Serial.println("LORA:Command queue full, can't send");
+    return handle;
+    }
+
+// Put a command in a free slot, and start it if the module is idle. Returns -1 if the queue is full.
+int RYLR998::_queue(const char* command, const uint8_t* data, size_t len, LoraCallback callback, unsigned long timeout)
+    {
+    for (int i=0;i<LORA_COMMAND_QUEUE_SIZE;i++)
+        {
+        if (_slots[i].state==SLOT_FREE)
+            {
+            CommandSlot& slot=_slots[i];
+            strncpy(slot.command, command, LORA_COMMAND_SIZE-1);
+            slot.command[LORA_COMMAND_SIZE-1]='\0';
+            slot.data=data;
+            slot.dataLen=len;
+            slot.response[0]='\0';
+            slot.callback=callback;
+            slot.timeout=timeout;
+            slot.timedOut=false;
+            slot.ticket=_nextTicket++;
+            slot.state=SLOT_QUEUED;
+            if (_active<0)
+                _startNext();
+            return i;
+            }
+        }
+    return -1;
+    }
+
+/*
+ * Move what the UART has received into the ring, a bounded amount at a time.
+ * Partial lines just wait there until the rest arrives.
+ */
+void RYLR998::_pump()
+    {
+    for (int i=0;i<LORA_RX_BURST && _serial->available();i++)
+        {
+        uint8_t c=_serial->read();
+        uint16_t next=(_rxHead+1) & (LORA_RX_RING_SIZE-1);
+        if (next==_rxTail)
+            {
+            _rxOverflows++;
+            continue;
+            }
+        _rxRing[_rxHead]=c;
+        _rxHead=next;
+        if (c=='\n')
+            _rxLines++;
+        }
+    }
+
+/*
+ * Take the next complete line out of the ring and into _line, without waiting.
+ * Returns false if no full line has arrived yet. Lines too long for _line
+ * are cut off and counted.
+ */
+bool RYLR998::_readLine()
+    {
+    _pump();
+
+    //a ring full of bytes with no end of line would never drain, so give it up as one line
+    bool full=((_rxHead+1) & (LORA_RX_RING_SIZE-1))==_rxTail;
+    if (_rxLines==0 && !full)
+        return false;
+
+    size_t len=0;
+    bool truncated=(_rxLines==0); //flushing a full ring
+    while (_rxTail!=_rxHead)
+        {
+        char c=_rxRing[_rxTail];
+        _rxTail=(_rxTail+1) & (LORA_RX_RING_SIZE-1);
+        if (c=='\n')
+            {
+            _rxLines--;
+            break;
+            }
+        if (len<LORA_LINE_SIZE-1)
+            _line[len++]=c;
+        else
+            truncated=true;
+        }
+    if (truncated)
+        _truncatedLines++;
+
+    while (len>0 && isspace((unsigned char)_line[len-1]))
+        len--;
+    _line[len]='\0';
+    return true;
+    }
+
+const RadioStats& RYLR998::getStats()
+    {
+    return _stats;
+    }
+
+// Restore statistics saved before a deep sleep
+void RYLR998::setStats(const RadioStats& stats)
+    {
+    _stats=stats;
+    }
+
+void RYLR998::clearStats()
+    {
+    memset(&_stats, 0, sizeof(_stats));
+    }
+
+void RYLR998::printStats(Print& out)
+    {
+    static const char* const names[LORA_CMD_TYPES]={"Test","Send","Set","Query","Other"};
+    out.println("Type   Count Timeouts Min(ms) Max(ms) Mean(ms)");
+    for (int i=0;i<LORA_CMD_TYPES;i++)
+        {
+        const CommandStats& c=_stats.commands[i];
+        uint16_t answered=c.count-c.timeouts;
+        out.printf("%-6s %5u %8u %7u %7u %8lu\n", names[i], c.count, c.timeouts,
+                   answered?c.minMs:0, answered?c.maxMs:0,
+                   answered?(unsigned long)(c.totalMs/answered):0ul);
+        }
+    out.print("Errors:");
+    bool any=false;
+    for (int i=0;i<=LORA_MAX_ERROR_CODE;i++)
+        {
+        if (_stats.errors[i])
+            {
+            out.printf(" %s%d=%u", i?"ERR":"other", i, _stats.errors[i]);
+            any=true;
+            }
+        }
+    out.println(any?"":" none");
+    }
+
+/*
+ * Measure what the link to the module costs: ask it for its radio parameters
+ * rounds times, and count the replies that don't match what queryAll() read.
+ * For the CPU time, a loop that keeps the driver serviced is timed with
+ * nothing arriving, and then while each reply comes in. The time the loop
+ * loses to a reply was spent taking in its bytes, whether in service() or in
+ * SoftwareSerial's interrupt. The results are printed to out as well.
+ */
+LinkBenchmark RYLR998::benchmarkLink(Print& out, int rounds)
+    {
+    static const char* const names[]={"SoftwareSerial","hardware UART","stream"};
+    LinkBenchmark result={0, 0, 0, 0};
+    if (!_shadowValid && !queryAll())
+        {
+        out.println(F("The module isn't answering, nothing to measure"));
+        return result;
+        }
+    char expected[LORA_RESPONSE_SIZE];
+    snprintf(expected, sizeof(expected), "+PARAMETER=%u,%u,%u,%u", _shadow.config.spreadingFactor,
+             _shadow.config.bandwidth, _shadow.config.codingRate, _shadow.config.preamble);
+
+    unsigned long passes=0;
+    unsigned long start=micros();
+    while (micros()-start<LORA_BENCH_IDLE_TIME)
+        {
+        service();
+        yield();
+        passes++;
+        }
+    float idlePass=(float)(micros()-start)/passes;
+
+    float busyUs=0;
+    for (int i=0;i<rounds;i++)
+        {
+        int handle=queueCommand("AT+PARAMETER?");
+        if (handle<0)
+            break;
+        passes=0;
+        start=micros();
+        while (!isComplete(handle))
+            {
+            service();
+            yield();
+            passes++;
+            }
+        float lost=(micros()-start)-passes*idlePass;
+        result.rounds++;
+        if (isTimedOut(handle))
+            result.errors++;
+        else
+            {
+            result.bytes+=strlen(getResponse(handle))+2;
+            if (strcmp(getResponse(handle), expected)!=0)
+                result.errors++;
+            if (lost>0)
+                busyUs+=lost;
+            }
+        release(handle);
+        }
+    if (result.bytes)
+        result.usPerByte=busyUs/result.bytes;
+
+    out.printf("Over %s: %u replies, %lu bytes, %.2fus CPU per byte, %u errors (%.1f%%)\n",
+               names[_transport], result.rounds, (unsigned long)result.bytes, result.usPerByte,
+               result.errors, result.rounds?100.0*result.errors/result.rounds:0.0);
+    return result;
+    }
+
+uint32_t RYLR998::getRxOverflows()
+    {
+    return _rxOverflows;
+    }
+
+uint32_t RYLR998::getTruncatedLines()
+    {
+    return _truncatedLines;
+    }
+
+// Route a complete line: +RCV frames go to handleIncoming() or the drain queue, anything else answers the active command
+void RYLR998::_dispatchLine()
+    {
+    if (_line[0]=='\0')
+        return;
+
+    if (strncmp(_line,"+RCV=",5)==0)
+        {
+        _framesHeard++;
+        if (_drainMode)
+            _queueFrame(_line);
+        else
+            {
+            strcpy(_rcvLine,_line);
+            _rcvPending=true;
+            }
+        }
+    else if (_active>=0)
         {
-        response = _serial.readStringUntil('\n');
-        response.trim();
         if (_debug)
-            Serial.println("LORA:"+response);
-        break;
+            Serial.println("LORA:"+String(_line));
+        strncpy(_slots[_active].response,_line,LORA_RESPONSE_SIZE-1);
+        _slots[_active].response[LORA_RESPONSE_SIZE-1]='\0';
+        _complete(_active, false);
         }
-      yield();
-      }
-    return response;
+    else if (_debug)
+        Serial.println("LORA:Unexpected line from LoRa:"+String(_line));
     }
 
-void RYLR998::_parseRcvString(const String& input, String& address, String& length, String& jsonData, String& rssi, String& snr) 
+void RYLR998::_complete(int slot, bool timedOut)
     {
-    int start = 0;
-    int end = input.indexOf(',', start);
-    address = input.substring(start, end);
-    
-    start = end + 1;
-    end = input.indexOf(',', start);
-    length = input.substring(start, end);
-    
-    start = end + 1;
-    end = input.lastIndexOf(',', input.lastIndexOf(',') - 1);
-    jsonData = input.substring(start, end);
-    
-    start = end + 1;
-    end = input.lastIndexOf(',');
-    rssi = input.substring(start, end);
-    
-    snr = input.substring(end + 1);
-    }
\ No newline at end of file
+    CommandSlot& s=_slots[slot];
+    _record(s.command, millis()-s.started, timedOut, s.response);
+    s.timedOut=timedOut;
+    s.state=SLOT_DONE;
+    _active=-1;
+    if (s.callback)
+        {
+        s.callback(slot, s.response, timedOut);
+        s.state=SLOT_FREE;
+        }
+    }
+
+// Add one finished command to the statistics
+void RYLR998::_record(const char* command, unsigned long latency, bool timedOut, const char* response)
+    {
+    LoraCommandType type;
+    if (strcmp(command,"AT")==0)
+        type=LORA_CMD_TEST;
+    else if (strncmp(command,"AT+SEND=",8)==0)
+        type=LORA_CMD_SEND;
+    else if (command[strlen(command)-1]=='?')
+        type=LORA_CMD_QUERY;
+    else if (strchr(command,'='))
+        type=LORA_CMD_SET;
+    else
+        type=LORA_CMD_OTHER;
+
+    CommandStats& c=_stats.commands[type];
+    if (c.count==0xFFFF)
+        return; //saturated, stop rather than wrap
+    c.count++;
+    if (timedOut)
+        {
+        c.timeouts++;
+        return;
+        }
+
+    uint16_t ms=latency>0xFFFF?0xFFFF:latency;
+    if (c.count-c.timeouts==1)
+        c.minMs=c.maxMs=ms;
+    c.minMs=min(c.minMs,ms);
+    c.maxMs=max(c.maxMs,ms);
+    c.totalMs+=ms;
+
+    if (strncmp(response,"+ERR=",5)==0)
+        {
+        int code=atoi(response+5);
+        if (code<1 || code>LORA_MAX_ERROR_CODE)
+            code=0;
+        if (_stats.errors[code]<0xFFFF)
+            _stats.errors[code]++;
+        }
+    }
+
+// Send the oldest queued command, if any
+void RYLR998::_startNext()
+    {
+    int next=-1;
+    for (int i=0;i<LORA_COMMAND_QUEUE_SIZE;i++)
+        {
+        if (_slots[i].state==SLOT_QUEUED
+            && (next<0 || (int32_t)(_slots[i].ticket-_slots[next].ticket)<0))
+            next=i;
+        }
+    if (next<0)
+        return;
+
+    CommandSlot& slot=_slots[next];
+    if (_debug)
+        {
+        Serial.print("LORA:Sending lora command:");
+        Serial.print(slot.command);
+        if (slot.data)
+            Serial.write(slot.data, slot.dataLen);
+        Serial.println();
+        }
+    if (slot.data)
+        {
+        //an AT+SEND: the header, then the payload from the caller's buffer
+        _serial->write((const uint8_t*)slot.command, strlen(slot.command));
+        _serial->write(slot.data, slot.dataLen);
+        _serial->write((const uint8_t*)"\r\n", 2);
+        }
+    else
+        _serial->println(slot.command);
+    slot.started=millis();
+    slot.state=SLOT_ACTIVE;
+    _active=next;
+    }
+
+/*
+ * Pick out reports that repeat the last sequence number seen from the same
+ * sender. On by default. handleIncoming() still returns true for a repeat,
+ * so it gets acked, but the document only holds its address and seq, and
+ * "dup":true so the caller knows not to publish it again.
+ */
+void RYLR998::setDuplicateFilter(bool enabled)
+    {
+    _filterDuplicates=enabled;
+    }
+
+// True if the last frame handleIncoming() saw was a repeat
+bool RYLR998::wasDuplicate()
+    {
+    return _duplicate;
+    }
+
+// Sender of the last frame handleIncoming() saw, repeat or not
+uint16_t RYLR998::getLastAddress()
+    {
+    return _lastAddress;
+    }
+
+uint32_t RYLR998::getDuplicateCount()
+    {
+    return _duplicates;
+    }
+
+/*
+ * Find the sender's entry in the node table, or make one. The table is open
+ * addressed with linear probing, so with it kept well under full this is a
+ * probe or two. If it is completely full, the entry at the sender's home slot
+ * is taken over rather than searching further.
+ */
+NodeEntry& RYLR998::_findNode(uint16_t address)
+    {
+    uint16_t home=(((uint32_t)address*2654435761u)>>16) & (LORA_NODE_TABLE_SIZE-1);
+    uint16_t slot=home;
+    do
+        {
+        NodeEntry& node=_nodes[slot];
+        if (!(node.flags & NODE_USED))
+            {
+            memset(&node, 0, sizeof(node));
+            node.address=address;
+            node.flags=NODE_USED;
+            _nodeCount++;
+            return node;
+            }
+        if (node.address==address)
+            return node;
+        slot=(slot+1) & (LORA_NODE_TABLE_SIZE-1);
+        } while (slot!=home);
+
+    if (_debug)
+        Serial.println("LORA:Node table full, forgetting "+String(_nodes[home].address));
+    memset(&_nodes[home], 0, sizeof(NodeEntry));
+    _nodes[home].address=address;
+    _nodes[home].flags=NODE_USED;
+    return _nodes[home];
+    }
+
+// Move an average kept in 1/16 dB toward a new reading
+static int16_t ewma(int16_t average, int16_t reading)
+    {
+    int16_t scaled=reading*16;
+    return average+((scaled-average)>>LORA_EWMA_SHIFT);
+    }
+
+/*
+ * Record a frame in its sender's entry. Returns true if it carries the same
+ * report sequence number as the sender's last report, which means its ack
+ * got lost and this is a repeat.
+ */
+bool RYLR998::_trackNode(const RcvFrame& frame, const ReportFrame* report)
+    {
+    NodeEntry& node=_findNode(frame.address);
+    if (node.frames==0)
+        {
+        node.rssiAvg=frame.rssi*16;
+        node.snrAvg=frame.snr*16;
+        }
+    else
+        {
+        node.rssiAvg=ewma(node.rssiAvg, frame.rssi);
+        node.snrAvg=ewma(node.snrAvg, frame.snr);
+        }
+    node.lastSeen=millis();
+    node.frames++;
+
+    bool repeat=false;
+    if (report)
+        {
+        repeat=(node.flags & NODE_HAS_SEQUENCE) && node.lastSequence==report->sequence;
+        node.lastSequence=report->sequence;
+        node.flags|=NODE_HAS_SEQUENCE;
+        if (repeat)
+            node.duplicates++;
+        }
+    return repeat;
+    }
+
+// What we know about a sender, or nullptr if we've never heard from it
+const NodeEntry* RYLR998::getNode(uint16_t address)
+    {
+    uint16_t home=(((uint32_t)address*2654435761u)>>16) & (LORA_NODE_TABLE_SIZE-1);
+    uint16_t slot=home;
+    do
+        {
+        const NodeEntry& node=_nodes[slot];
+        if (!(node.flags & NODE_USED))
+            return nullptr;
+        if (node.address==address)
+            return &node;
+        slot=(slot+1) & (LORA_NODE_TABLE_SIZE-1);
+        } while (slot!=home);
+    return nullptr;
+    }
+
+// For walking the table: the entry in a slot, or nullptr if the slot is empty
+const NodeEntry* RYLR998::getNodeAt(uint16_t slot)
+    {
+    if (slot>=LORA_NODE_TABLE_SIZE || !(_nodes[slot].flags & NODE_USED))
+        return nullptr;
+    return &_nodes[slot];
+    }
+
+uint16_t RYLR998::getNodeCount()
+    {
+    return _nodeCount;
+    }
+
+void RYLR998::clearNodes()
+    {
+    memset(_nodes, 0, sizeof(_nodes));
+    _nodeCount=0;
+    }
+
+static const char base64Chars[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static int base64Value(char c)
+    {
+    const char* p=strchr(base64Chars, c);
+    return (c && p)?p-base64Chars:-1;
+    }
+
+static uint8_t* put16(uint8_t* p, uint16_t value)
+    {
+    *p++=value & 0xFF;
+    *p++=value >> 8;
+    return p;
+    }
+
+static uint16_t get16(const uint8_t* p)
+    {
+    return p[0] | (p[1]<<8);
+    }
+
+/*
+ * Pack a report, with any buffered readings, and encode it for AT+SEND.
+ * Returns the text length, or 0 if out is too small.
+ */
+size_t RYLR998::encodeReport(const ReportFrame& report, char* out, size_t size)
+    {
+    uint8_t bytes[LORA_FRAME_MAX_BYTES];
+    uint8_t count=min(report.readingCount,(uint8_t)LORA_MAX_BATCH);
+    uint8_t* b=bytes;
+    *b++=count?LORA_FRAME_VERSION_BATCH:LORA_FRAME_VERSION;
+    *b++=report.flags;
+    b=put16(b, report.sequence);
+    b=put16(b, report.distance);
+    b=put16(b, report.batteryMv);
+    if (count)
+        {
+        *b++=count;
+        for (int i=0;i<count;i++)
+            {
+            b=put16(b, report.readings[i].age);
+            b=put16(b, report.readings[i].distance);
+            b=put16(b, report.readings[i].batteryMv);
+            }
+        }
+
+    size_t byteCount=b-bytes;
+    size_t len=1+(byteCount*8+5)/6;
+    if (size<len+1)
+        return 0;
+
+    char* p=out;
+    *p++=LORA_FRAME_MARKER;
+    uint32_t bits=0;
+    int bitCount=0;
+    for (size_t i=0;i<byteCount;i++)
+        {
+        bits=(bits<<8) | bytes[i];
+        bitCount+=8;
+        while (bitCount>=6)
+            {
+            bitCount-=6;
+            *p++=base64Chars[(bits>>bitCount) & 0x3F];
+            }
+        }
+    if (bitCount>0)
+        *p++=base64Chars[(bits<<(6-bitCount)) & 0x3F];
+    *p='\0';
+    return p-out;
+    }
+
+// Turn an encoded report back into its fields. Returns false if it isn't one we understand.
+bool RYLR998::decodeReport(const char* data, size_t len, ReportFrame& report)
+    {
+    if (len<1 || data[0]!=LORA_FRAME_MARKER)
+        return false;
+
+    uint8_t bytes[LORA_FRAME_MAX_BYTES];
+    size_t count=0;
+    uint32_t bits=0;
+    int bitCount=0;
+    for (size_t i=1;i<len && count<LORA_FRAME_MAX_BYTES;i++)
+        {
+        int value=base64Value(data[i]);
+        if (value<0)
+            return false;
+        bits=(bits<<6) | value;
+        bitCount+=6;
+        if (bitCount>=8)
+            {
+            bitCount-=8;
+            bytes[count++]=(bits>>bitCount) & 0xFF;
+            }
+        }
+    if (count<LORA_FRAME_BYTES)
+        return false;
+
+    report.version=bytes[0];
+    report.flags=bytes[1];
+    report.sequence=get16(bytes+2);
+    report.distance=get16(bytes+4);
+    report.batteryMv=get16(bytes+6);
+    report.readingCount=0;
+
+    if (report.version==LORA_FRAME_VERSION)
+        return true;
+    if (report.version!=LORA_FRAME_VERSION_BATCH || count<LORA_FRAME_BYTES+1)
+        return false;
+
+    uint8_t readings=bytes[LORA_FRAME_BYTES];
+    if (readings>LORA_MAX_BATCH || count<(size_t)(LORA_FRAME_BYTES+1+readings*LORA_READING_BYTES))
+        return false;
+    const uint8_t* b=bytes+LORA_FRAME_BYTES+1;
+    for (int i=0;i<readings;i++)
+        {
+        report.readings[i].age=get16(b);
+        report.readings[i].distance=get16(b+2);
+        report.readings[i].batteryMv=get16(b+4);
+        b+=LORA_READING_BYTES;
+        }
+    report.readingCount=readings;
+    return true;
+    }
+
+// The last binary report handleIncoming() decoded, including any buffered readings
+const ReportFrame& RYLR998::getLastReport()
+    {
+    return _lastReport;
+    }
+
+// Read a signed decimal number at p, stopping at the first non-digit. Returns false if there were no digits.
+static bool parseNumber(const char*& p, const char* end, long& value)
+    {
+    bool negative=false;
+    if (p<end && *p=='-')
+        {
+        negative=true;
+        p++;
+        }
+    const char* digits=p;
+    value=0;
+    while (p<end && *p>='0' && *p<='9')
+        value=value*10+(*p++-'0');
+    if (negative)
+        value=-value;
+    return p>digits;
+    }
+
+/*
+ * Split a "+RCV=<Address>,<Length>,<Data>,<RSSI>,<SNR>" line into its fields
+ * without copying anything. The data may itself contain commas, so it is
+ * taken to run up to the second-to-last comma on the line.
+ */
+bool RYLR998::parseRcv(const char* line, RcvFrame& frame)
+    {
+    if (strncmp(line,"+RCV=",5)!=0)
+        return false;
+
+    const char* p=line+5;
+    const char* end=line+strlen(line);
+    long address, length, rssi, snr;
+
+    if (!parseNumber(p, end, address) || p>=end || *p++!=',')
+        return false;
+    if (!parseNumber(p, end, length) || p>=end || *p++!=',')
+        return false;
+    frame.address=address;
+    frame.length=length;
+    frame.payload=p;
+
+    // find the two trailing commas that delimit RSSI and SNR
+    const char* lastComma=end;
+    while (lastComma>p && *--lastComma!=',');
+    const char* rssiComma=lastComma;
+    while (rssiComma>p && *--rssiComma!=',');
+    if (*lastComma!=',' || *rssiComma!=',' || rssiComma<p)
+        return false;
+    frame.payloadLen=rssiComma-p;
+
+    p=rssiComma+1;
+    if (!parseNumber(p, end, rssi) || p>=end || *p++!=',')
+        return false;
+    if (!parseNumber(p, end, snr))
+        return false;
+    frame.rssi=rssi;
+    frame.snr=snr;
+    return true;
+    }
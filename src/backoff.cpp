@@ -0,0 +1,13 @@
+/*
+ * The random transmit backoff's window. Kept apart from main.cpp so the host
+ * tests can build it.
+ */
+
+#include <Arduino.h>
+#include "delivery_reporter_lora.h"
+
+// How many slots to pick the wait from: 2^exponent, doubling no further than BACKOFF_MAX_EXPONENT
+unsigned long backoffSlots(uint8_t exponent)
+  {
+  return 1ul<<min(exponent,(uint8_t)BACKOFF_MAX_EXPONENT);
+  }
@@ -0,0 +1,54 @@
+/*
+ * Picking one distance out of several samples. Kept apart from main.cpp so
+ * the host tests can build it.
+ */
+
+#include <Arduino.h>
+#include "delivery_reporter_lora.h"
+
+/*
+ * See whether the newest of the samples so far has brought enough of them
+ * into agreement. Samples agree if they are all within tolerance of one
+ * of them. Only a group that includes the newest sample can have grown, so
+ * only those are counted. If one is big enough its average goes in answer.
+ */
+bool findConsensus(int* vals, int count, int needed, int tolerance, int* answer)
+  {
+  int newest=vals[count-1];
+  for (int c=0;c<count;c++)
+    {
+    int center=vals[c];
+    if (abs(center-newest)>tolerance)
+      continue; //a group around this one can't include the newest sample
+    long sum=0;
+    int members=0;
+    for (int i=0;i<count;i++)
+      {
+      if (abs(vals[i]-center)<=tolerance)
+        {
+        sum+=vals[i];
+        members++;
+        }
+      }
+    if (members>=needed)
+      {
+      *answer=(sum+members/2)/members;
+      return true;
+      }
+    }
+  return false;
+  }
+
+// The middle value of the samples, for when they never agreed
+int median(int* vals, int count)
+  {
+  int sorted[SAMPLE_COUNT];
+  for (int i=0;i<count;i++)
+    {
+    int j=i;
+    for (;j>0 && sorted[j-1]>vals[i];j--)
+      sorted[j]=sorted[j-1];
+    sorted[j]=vals[i];
+    }
+  return sorted[count/2];
+  }
@@ -132,13 +132,14 @@
 #include "user_interface.h"
 #include <EEPROM.h>
 #include <VL53L0X.h>
+#include "CachedVL53L0X.h"
 #include <Adafruit_SSD1306.h>
 #include <Adafruit_GFX.h>
 #include <LoRa.h>
 #include "RYLR998.h"
 #include "delivery_reporter_lora.h"
 
-VL53L0X sensor;
+CachedVL53L0X sensor;
 Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET);
 
 RYLR998 lora(LORA_RX_PIN, LORA_TX_PIN);
@@ -168,26 +169,69 @@ typedef struct
   byte loRaPreamble=DEFAULT_LORA_PREAMBLE;
   uint32_t loRaBaudRate=DEFAULT_LORA_BAUD_RATE; //both for RF and RYLR998 serial comms
   unsigned int loRaPower=DEFAULT_LORA_POWER; //dbm
+  bool adr=true;              //adapt the transmit power to the link margin
+  bool lbt=false;             //listen before sending (hears only frames to us or to broadcast)
+  bool continuousRanging=true; //take the samples back to back instead of one at a time
+  uint32_t timingBudget=DEFAULT_TIMING_BUDGET;       //microseconds per range
+  uint8_t vcselPreRange=DEFAULT_VCSEL_PRE_RANGE;     //laser pulse periods in PCLKs
+  uint8_t vcselFinalRange=DEFAULT_VCSEL_FINAL_RANGE;
+  float signalRateLimit=DEFAULT_SIGNAL_RATE_LIMIT;   //MCPS
+  int consensusTolerance=DEFAULT_CONSENSUS_TOLERANCE; //mm between samples that agree
+  int consensusCount=DEFAULT_CONSENSUS_COUNT;         //samples that must agree
+  bool quickCheck=true;       //accept one range if it matches the last measurement
+  int sensorInterruptPin=-1;  //pin wired to the sensor's GPIO1, or -1 to poll for ranges
   } conf;
 
 conf settings; //all settings in one struct makes it easier to store in EEPROM
+
+//Named VL53L0X setups, from quickest to most precise
+typedef struct
+  {
+  const char* name;
+  uint32_t timingBudget;
+  uint8_t vcselPreRange;
+  uint8_t vcselFinalRange;
+  float signalRateLimit;
+  } RangingProfile;
+
+const RangingProfile rangingProfiles[]=
+  {
+  {"fast",     20000, 14, 10, 0.25},
+  {"balanced", 33000, 14, 10, 0.25},
+  {"accurate",200000, 14, 10, 0.25},
+  };
+#define RANGING_PROFILE_COUNT (sizeof(rangingProfiles)/sizeof(rangingProfiles[0]))
 boolean settingsAreValid=false;
 
 String commandString = "";     // a String to hold incoming commands from serial
 bool commandComplete = false;  // goes true when enter is pressed
 
 unsigned long doneTimestamp=0; //used to allow publishes to complete before sleeping
+unsigned long lastAirtime=0;   //estimated time on air of the last report, in milliseconds
+bool reporting=false;          //report() is waiting on the radio, so console commands leave it alone
+int ackSnr=0;                  //signal to noise ratio of the last ack received
 
 //This is true if a package is detected. It will be written to RTC memory 
 // as "wasPresent" just before sleeping
 bool isPresent=false;
 
+//Set by the sensor's data ready interrupt
+volatile bool rangeReady=false;
+
 //This is the distance measured on this pass.
 int distance=0;
 
 boolean rssiShowing=false; //used to redraw the RSSI indicator after clearing display
 String lastMessage=""; //contains the last message sent to display. Sometimes need to reshow it
 
+// A reading taken on a wake that didn't report, kept to go out with the next report
+typedef struct
+  {
+  uint32_t time;              // myMillis()/1000 when it was taken
+  uint16_t distance;
+  uint16_t batteryMv;
+  } BufferedReading;
+
 //We should report at least once per hour, whether we have a package or not.  This
 //will also let us retrieve any outstanding MQTT messages.  Since the internal millis()
 //counter is reset every time it wakes up, we need to save it before sleeping and restore
@@ -195,25 +239,49 @@ String lastMessage=""; //contains the last message sent to display. Sometimes ne
 //memory, which is kept alive by the battery or power supply.
 typedef struct
   {
+  unsigned int validRtc=VALID_RTC_FLAG; //RTC memory holds garbage after a power-up
   unsigned long nextHealthReportTime=0;//the RTC for the next report, regardless of readings
   unsigned long rtc=0;        //the RTC maintained over sleep periods
   bool wasPresent=false;      //Package present on last check
   bool presentReported=false; //MQTT Package Present report was sent
   bool absentReported=false;  //MQTT Package Removed report was sent
   bool acked=true;            // true when last report was acknowledged by receiver
+  uint16_t sequence=0;        // number of the last report frame sent
+  bool sequencePresent=false; // presence reported under that number
+  uint8_t adrPower=0;         // transmit power chosen by ADR, 0 if not chosen yet
+  int8_t adrMargins[ADR_HISTORY]={0}; // link margins in dB of recent acks at adrPower
+  uint8_t adrMarginCount=0;
+  uint8_t missedAcks=0;       // reports in a row that got no ack
+  uint16_t collisions=0;      // reports that got no ack, most likely lost to another sender
+  uint16_t retries=0;         // reports sent again because the last one got no ack
+  uint16_t busyChannel=0;     // times listen-before-talk heard someone else and backed off
+  bool quickValid=false;      // lastDistance can be used for a quick check
+  int16_t lastDistance=0;     // the last measurement the samples agreed on
+  uint16_t lastSpread=0;      // and how far its samples strayed from it
+  VL53L0XCalibration sensorCalibration={}; // so the sensor can skip its calibration
+  uint16_t calibrationAge=0;  // warm starts since the sensor was last fully calibrated
+  uint16_t fullInitTime=0;    // milliseconds the last full sensor init took
+  uint16_t lastAckRtt=0;      // milliseconds from sending a report to its ack
+  uint16_t minAckRtt=0xFFFF;
+  uint16_t maxAckRtt=0;
+  BufferedReading batch[LORA_MAX_BATCH]; // ring of readings not yet reported, oldest at batchStart
+  uint8_t batchStart=0;
+  uint8_t batchCount=0;
+  RadioStats loraStats;       // radio timing and error counts, kept across sleeps
   } MY_RTC;
   
 MY_RTC myRtc;
 
 ADC_MODE(ADC_VCC); //so we can use the ADC to measure the battery voltage
 
-/* Like delay() but checks for serial input */
+/* Like delay() but checks for serial input and keeps the radio moving */
 void myDelay(ulong ms)
   {
   ulong doneTime=millis()+ms;
   while(millis()<doneTime)
     {
     checkForCommand();
+    lora.service();
     delay(10);
     }
   }
@@ -288,8 +356,16 @@ void show(uint16_t val, String suffix)
     //   }
     }
 
-// Configure LoRa module
-void initLoRa()
+// Completion handler for the queued LoRa test command
+void loraTestDone(int handle, const char* response, bool timedOut)
+  {
+  String loraOK=(!timedOut && strcmp(response,"+OK")==0)?"OK":"\nFailed";
+  Serial.println(loraOK);
+  show("Lora "+loraOK);
+  }
+
+// Configure LoRa module. Returns false if the radio didn't answer.
+bool initLoRa()
   {
   if (settingsAreValid)
     {
@@ -297,29 +373,136 @@ void initLoRa()
       Serial.println(F("++++++++ initializing LoRa radio ++++++++++++"));
 
     loraRadio(LORA_ON); //turn on the LORA radio
-    lora.begin((long)settings.loRaBaudRate);
+    if (!lora.begin((long)settings.loRaBaudRate))
+      {
+      Serial.println("LoRa radio is not responding.");
+      show("Lora\nFailed");
+      loraRadio(LORA_OFF); //don't waste the battery, we'll try again next time
+      return false;
+      }
+    if (lora.getDetectedBaudRate()!=(long)settings.loRaBaudRate)
+      {
+      Serial.print("LoRa radio answered at ");
+      Serial.print(lora.getDetectedBaudRate());
+      Serial.print(" baud instead of ");
+      Serial.println(settings.loRaBaudRate);
+      }
     lora.setJsonDocument(doc);
+    applyLoRaSettings(); //only writes what the module doesn't already have
     if (settings.debug)
       {
       Serial.print("\nTesting LoRa device...");
-      String loraOK=lora.testComm()?"OK":"\nFailed";
-      Serial.println(loraOK);
-      show("Lora "+loraOK);
-      delay(1000);
+      lora.queueCommand("AT",loraTestDone); //answer shows up while we carry on
       }
+    return true;
     }
+  return false;
   }
 
-// Configure some LoRa parameters. I don't know why these particular ones
-// are set all in one bunch on the RYLR998
-void setLoRaParameters()
+// Push our LoRa settings to the RYLR998. The driver compares them with what
+// the module already holds and only sends the ones that changed.
+void applyLoRaSettings()
   {
   if (settingsAreValid)
     {
-    lora.setParameter(settings.loRaSpreadingFactor, 
-                      settings.loRaBandwidth, 
-                      settings.loRaCodingRate, 
-                      settings.loRaPreamble);
+    RadioConfig config;
+    config.address=settings.loRaAddress;
+    config.networkID=settings.loRaNetworkID;
+    config.band=settings.loRaBand;
+    config.spreadingFactor=settings.loRaSpreadingFactor;
+    config.bandwidth=settings.loRaBandwidth;
+    config.codingRate=settings.loRaCodingRate;
+    config.preamble=settings.loRaPreamble;
+    config.cpin[0]='\0'; //we don't manage the password
+    config.power=loraPower();
+    lora.applyConfig(config);
+    }
+  }
+
+// The radio is off except while reporting, so a changed LoRa setting is only
+// saved. initLoRa() applies it the next time the radio comes on.
+void loraSettingSaved()
+  {
+  Serial.println("Saved. The radio will be updated when it next reports.");
+  }
+
+// Estimated time on air in milliseconds for a payload at the current radio settings
+unsigned long airtime(size_t payloadLen)
+  {
+  uint32_t us=loraTimeOnAir(settings.loRaSpreadingFactor,
+                            settings.loRaBandwidth,
+                            settings.loRaCodingRate,
+                            settings.loRaPreamble,
+                            payloadLen);
+  return (us+999)/1000;
+  }
+
+// The transmit power to use: whatever ADR has settled on, or the configured power
+uint8_t loraPower()
+  {
+  if (settings.adr && myRtc.adrPower>0 && myRtc.adrPower<=settings.loRaPower)
+    return myRtc.adrPower;
+  return settings.loRaPower;
+  }
+
+/*
+ * Adaptive data rate. Every ack tells us how much signal we have to spare:
+ * its SNR above the demodulation floor for our spreading factor. When the
+ * last few acks all had margin to spare, turn the transmit power down a step.
+ * A missed ack turns it back up, and a couple in a row go straight back to
+ * full power. The spreading factor is left alone because the receiver only
+ * listens on one, so a node that changed its own would go deaf to it.
+ *
+ * The ack was sent at the receiver's power, which we assume is our configured
+ * power, so the margin is corrected for how far we've turned ourselves down.
+ */
+void adaptDataRate()
+  {
+  if (!settings.adr)
+    return;
+
+  uint8_t power=loraPower();
+  if (!myRtc.acked)
+    {
+    myRtc.adrMarginCount=0;
+    if (myRtc.missedAcks>=ADR_MISSED_LIMIT)
+      power=settings.loRaPower;
+    else
+      power=min(power+ADR_POWER_STEP,(int)settings.loRaPower);
+    }
+  else
+    {
+    int floorDb=-(settings.loRaSpreadingFactor-4)*5/2; //SNR needed to demodulate
+    int margin=ackSnr-floorDb-(int)(settings.loRaPower-power);
+    myRtc.adrMargins[myRtc.adrMarginCount%ADR_HISTORY]=constrain(margin,-128,127);
+    myRtc.adrMarginCount=min((int)myRtc.adrMarginCount+1,ADR_HISTORY);
+
+    int worst=127;
+    for (int i=0;i<myRtc.adrMarginCount;i++)
+      worst=min(worst,(int)myRtc.adrMargins[i]);
+    if (myRtc.adrMarginCount>=ADR_HISTORY
+        && worst-ADR_POWER_STEP>=ADR_TARGET_MARGIN
+        && power-ADR_POWER_STEP>=ADR_MIN_POWER)
+      {
+      power-=ADR_POWER_STEP;
+      myRtc.adrMarginCount=0; //start measuring again at the new power
+      }
+    if (settings.debug)
+      {
+      Serial.print("Link margin ");
+      Serial.print(margin);
+      Serial.print(" dB, worst recent ");
+      Serial.print(worst);
+      Serial.println(" dB");
+      }
+    }
+
+  if (power!=myRtc.adrPower)
+    {
+    Serial.print("ADR: transmit power now ");
+    Serial.print(power);
+    Serial.println(" dBm");
+    myRtc.adrPower=power;
     }
   }
 
@@ -327,22 +510,31 @@ void setLoRaParameters()
 void showLoraSettings()
   {
   Serial.println("\n*** Internal RYLR998 settings ***");
+  if (!lora.queryAll())
+    Serial.println("(Some settings could not be read)");
+  const RadioState& state=lora.getState();
   Serial.print("Address: ");
-  Serial.println(lora.getAddress());
+  Serial.println(state.config.address);
   Serial.print("Network ID: ");
-  Serial.println(lora.getNetworkID());
+  Serial.println(state.config.networkID);
   Serial.print("Band: ");
-  Serial.println(lora.getBand());
+  Serial.println(state.config.band);
   Serial.print("Baud Rate: ");
-  Serial.println(lora.getBaudRate());
+  Serial.println(state.baudRate);
   Serial.print("Mode: ");
-  Serial.println(lora.getMode());
+  Serial.println(state.mode);
   Serial.print("Parameters: ");
-  Serial.println(lora.getParameter());
+  Serial.print(state.config.spreadingFactor);
+  Serial.print(",");
+  Serial.print(state.config.bandwidth);
+  Serial.print(",");
+  Serial.print(state.config.codingRate);
+  Serial.print(",");
+  Serial.println(state.config.preamble);
   Serial.print("Password: ");
-  Serial.println(lora.getCPIN());
+  Serial.println(state.config.cpin);
   Serial.print("RF Power: ");
-  Serial.println(lora.getRFPower());
+  Serial.println(state.config.power);
   }
 
 
@@ -363,17 +555,50 @@ void initSensor()
   while (++retry)
     {
     yield();
-    if (sensor.init()) 
+    //Reuse the calibration from an earlier wake if there is one and it isn't too old
+    unsigned long start=millis();
+    bool warm=myRtc.sensorCalibration.valid==VL53L0X_CALIBRATION_FLAG
+              && myRtc.calibrationAge<SENSOR_CALIBRATION_LIFE;
+    bool ok=warm?sensor.warmInit(myRtc.sensorCalibration):sensor.init();
+    if (ok) 
       {
+      sensor.setTimeout(SENSOR_TIMEOUT); //don't hang if a range never finishes
+      applySensorSettings();
+      unsigned long initTime=millis()-start; //ranging settings included, they can calibrate too
+      if (warm)
+        myRtc.calibrationAge++;
+      else
+        {
+        //after the ranging settings, since new VCSEL periods redo the phase calibration
+        sensor.captureCalibration();
+        myRtc.sensorCalibration=sensor.getCalibration();
+        myRtc.calibrationAge=0;
+        myRtc.fullInitTime=initTime;
+        }
+      attachSensorInterrupt();
       if (settings.debug)
         {
         Serial.println("VL53L0X init OK!");
+        Serial.print(warm?"Warm":"Full");
+        Serial.print(" sensor init took ");
+        Serial.print(initTime);
+        Serial.print(" ms");
+        if (warm)
+          {
+          Serial.print(", saving ");
+          Serial.print((long)myRtc.fullInitTime-(long)initTime);
+          Serial.print(" ms");
+          }
+        Serial.println();
         show("Sensor\nOK");
         }
       break;
       } 
     else 
       {
+      myRtc.sensorCalibration.valid=0; //calibrate from scratch next time
+      if (warm)
+        continue; //and right now, without complaining yet
       yield();
       if (retry==1)
         {
@@ -407,6 +632,12 @@ void initSerial()
 void initSettings()
   {
   system_rtc_mem_read(64, &myRtc, sizeof(myRtc)); //load the last saved timestamps from before our nap
+  if (myRtc.validRtc!=VALID_RTC_FLAG) //first time since power-up
+    {
+    myRtc=MY_RTC();
+    myRtc.sequence=ESP.random(); //so the receiver doesn't take our first report for an old one
+    }
+  lora.setStats(myRtc.loraStats);
   EEPROM.begin(sizeof(settings)); //fire up the eeprom section of flash
   commandString.reserve(200); // reserve 200 bytes of serial buffer space for incoming command string
 
@@ -429,9 +660,13 @@ void initSettings()
 //Take a measurement
 int getDistance()
   {
-  yield(); //I think there's a bug in the VL53L0X library code  
-  distance=sensor.readRangeSingleMillimeters();
-  yield(); //It occasionally triggers the watchdog timer
+  rangeReady=false;
+  distance=sensor.startRangeSingle()?waitForRange():0;
+  if (sensor.timeoutOccurred()) //also clears it, so the next read doesn't see a stale one
+    {
+    Serial.println("Ranging timed out!");
+    return -1;
+    }
   if (distance) 
     {
     if (settings.debug)
@@ -447,6 +682,169 @@ int getDistance()
   return distance?distance:-1;
   }
 
+// What the sensor accepts. The console and fixNewSettings() both check against these.
+bool validTimingBudget(uint32_t budget)
+  {
+  return budget>=20000 && budget<=1000000; //the sensor's minimum, and a second
+  }
+
+bool validVcselPreRange(int period)
+  {
+  return period>=12 && period<=18 && period%2==0;
+  }
+
+bool validVcselFinalRange(int period)
+  {
+  return period>=8 && period<=14 && period%2==0;
+  }
+
+bool validSignalRateLimit(float limit)
+  {
+  return limit>=0 && limit<=511.99; //also false for NaN
+  }
+
+/*
+ * Set the sensor up the way the settings say, touching only what differs
+ * from what it has now. Setting a pulse period makes the library rerun the
+ * phase calibration, which would undo the saved one, so that is skipped
+ * when the period is already right. The pulse periods go first because
+ * changing them moves the timing budget.
+ */
+bool applySensorSettings()
+  {
+  bool ok=true;
+  if (fabs(sensor.getSignalRateLimit()-settings.signalRateLimit)>0.01)
+    ok=sensor.setSignalRateLimit(settings.signalRateLimit);
+  if (ok && sensor.getVcselPulsePeriod(VL53L0X::VcselPeriodPreRange)!=settings.vcselPreRange)
+    ok=sensor.setVcselPulsePeriod(VL53L0X::VcselPeriodPreRange,settings.vcselPreRange);
+  if (ok && sensor.getVcselPulsePeriod(VL53L0X::VcselPeriodFinalRange)!=settings.vcselFinalRange)
+    ok=sensor.setVcselPulsePeriod(VL53L0X::VcselPeriodFinalRange,settings.vcselFinalRange);
+  if (ok && sensor.getMeasurementTimingBudget()!=settings.timingBudget)
+    ok=sensor.setMeasurementTimingBudget(settings.timingBudget);
+  if (!ok)
+    Serial.println("The sensor did not accept its ranging settings!");
+  return ok;
+  }
+
+/*
+ * Try each ranging profile on whatever the sensor is looking at, and show
+ * how long a range takes and how much it varies, so each box can be given
+ * the quickest profile that is steady enough. The sensor is put back to its
+ * own settings afterward.
+ */
+void sweepRangingProfiles()
+  {
+  conf saved=settings;
+  Serial.println("\nProfile   Budget(us) Time(ms) Mean(mm) StdDev(mm) Failed");
+  for (unsigned int p=0;p<RANGING_PROFILE_COUNT;p++)
+    {
+    const RangingProfile& profile=rangingProfiles[p];
+    settings.timingBudget=profile.timingBudget;
+    settings.vcselPreRange=profile.vcselPreRange;
+    settings.vcselFinalRange=profile.vcselFinalRange;
+    settings.signalRateLimit=profile.signalRateLimit;
+    applySensorSettings();
+
+    float sum=0,sumSquares=0;
+    int good=0;
+    unsigned long start=millis();
+    rangeReady=false;
+    sensor.startContinuous(0);
+    for (int i=0;i<SWEEP_SAMPLES;i++)
+      {
+      int range=getContinuousDistance();
+      if (range>0 && range<MAX_DIST)
+        {
+        sum+=range;
+        sumSquares+=(float)range*range;
+        good++;
+        }
+      }
+    sensor.stopContinuous();
+    unsigned long elapsed=millis()-start;
+
+    float mean=good?sum/good:0;
+    float variance=good?sumSquares/good-mean*mean:0;
+    Serial.printf("%-9s %10lu %8.1f %8.1f %10.2f %6d\n", profile.name, (unsigned long)profile.timingBudget,
+                  (float)elapsed/SWEEP_SAMPLES, mean, sqrt(max(variance,0.0f)), SWEEP_SAMPLES-good);
+    yield();
+    }
+  settings=saved;
+  applySensorSettings();
+  }
+
+IRAM_ATTR void rangeIsReady()
+  {
+  rangeReady=true;
+  }
+
+/*
+ * GPIO6-11 belong to the flash chip and GPIO16 can't interrupt, so none of
+ * them can take the sensor's data ready signal. -1 means poll instead.
+ */
+bool validInterruptPin(int pin)
+  {
+  return pin==-1 || (pin>=0 && pin<=15 && (pin<6 || pin>11));
+  }
+
+// Have the sensor's data ready line tell us when a range is done, if it's wired up
+void attachSensorInterrupt()
+  {
+  if (settings.sensorInterruptPin<0)
+    return;
+  pinMode(settings.sensorInterruptPin,INPUT_PULLUP); //the sensor pulls it low when a range is ready
+  attachInterrupt(digitalPinToInterrupt(settings.sensorInterruptPin),rangeIsReady,FALLING);
+  }
+
+/*
+ * Wait for the range in progress and read it. With the data ready interrupt
+ * the wait is spent keeping the radio going, rather than asking the sensor
+ * over I2C again and again whether it's done. If the interrupt never comes
+ * the read falls back to polling. Console input stays in the serial buffer
+ * until the measurement is done, since a command could reconfigure the
+ * sensor in the middle of a range.
+ */
+uint16_t waitForRange()
+  {
+  int pin=settings.sensorInterruptPin;
+  if (pin>=0)
+    {
+    unsigned long start=millis();
+    while (!rangeReady && digitalRead(pin)!=LOW && millis()-start<SENSOR_TIMEOUT)
+      {
+      lora.service();
+      delay(1); //let the CPU idle until the next interrupt or tick
+      }
+    if (!rangeReady && digitalRead(pin)!=LOW)
+      Serial.println("No data ready signal from the sensor, polling instead.");
+    rangeReady=false;
+    }
+  yield(); //I think there's a bug in the VL53L0X library code  
+  uint16_t range=sensor.readRangeContinuousMillimeters(); //this also clears the interrupt
+  yield(); //It occasionally triggers the watchdog timer
+  return range;
+  }
+
+/*
+ * Read the next range while the sensor is ranging continuously. This waits
+ * only for the measurement in progress, with no gap between samples.
+ */
+int getContinuousDistance()
+  {
+  uint16_t range=waitForRange();
+  if (sensor.timeoutOccurred())
+    {
+    Serial.println("Ranging timed out!");
+    return -1;
+    }
+  if (settings.debug)
+    {
+    Serial.print("Inst. Dist. (mm): ");
+    Serial.println(range);
+    }
+  return range?range:-1;
+  }
+
 void initDisplay()
   {
   pinMode(PORT_DISPLAY,OUTPUT); //port for display power
@@ -501,6 +899,8 @@ void setup()
     //initialize everything
     initDisplay();
     initSensor(); //sensor should be initialized after display because display sets up i2c
+    if (ESP.getResetInfoPtr()->reason!=REASON_DEEP_SLEEP_AWAKE)
+      sweepRangingProfiles(); //fresh start, show how the ranging profiles do here
     // initLoRa(); //only do this when reporting
 
     //Get a measurement and compare the presence with the last one stored in EEPROM.
@@ -553,6 +953,7 @@ void checkForAck()
     {
     Serial.println("ACK received.");
     myRtc.acked=true;
+    ackSnr=doc["snr"];
     doc.clear();
     }
   else
@@ -568,6 +969,7 @@ void checkForAck()
 void loop()
   {
   checkForCommand(); // Check for input in case something needs to be changed to work
+  lora.service();    // move any queued radio commands along
   
   if (settingsAreValid && settings.sleeptime==0) //if sleepTime is zero then don't sleep
     {
@@ -674,21 +1076,71 @@ void sendOrNot()
     doneTimestamp=millis(); //this is to allow the publish to complete before sleeping
     if (myMillis()>myRtc.nextHealthReportTime)
       {
+      unsigned long before=myMillis()/1000;
       myRtc.rtc=millis(); //122024dep reset this to keep it from overflowing in 49 days
+      unsigned long shift=before-myMillis()/1000;
+      for (int i=0;i<LORA_MAX_BATCH;i++) //keep any unsent readings on the same clock
+        myRtc.batch[i].time=myRtc.batch[i].time>shift?myRtc.batch[i].time-shift:0;
       }
     myRtc.nextHealthReportTime=myMillis()+ONE_HOUR;
-    myDelay(5000); //wait for any incoming messages
+    }
+  else
+    {
+    bufferReading(); //nothing to say now, but keep it for the next report
+    }
+  }
+
+/*
+ * Save this wake's reading in RTC memory so that the next report can carry
+ * the whole history in one transmission. When the ring is full the oldest
+ * reading makes way.
+ */
+void bufferReading()
+  {
+  if (myRtc.batchCount==LORA_MAX_BATCH)
+    {
+    myRtc.batchStart=(myRtc.batchStart+1)%LORA_MAX_BATCH;
+    myRtc.batchCount--;
+    }
+  BufferedReading& reading=myRtc.batch[(myRtc.batchStart+myRtc.batchCount)%LORA_MAX_BATCH];
+  reading.time=myMillis()/1000;
+  reading.distance=(distance<0 || distance>=LORA_DISTANCE_INVALID)?LORA_DISTANCE_INVALID:distance;
+  reading.batteryMv=convertToMillivolts(readBattery());
+  myRtc.batchCount++;
+  if (settings.debug)
+    {
+    Serial.print("Buffered reading ");
+    Serial.print(myRtc.batchCount);
+    Serial.print(" of ");
+    Serial.println(LORA_MAX_BATCH);
     }
   }
 
 /* Draw a dot at a point on the screen, and increment to the next position */
-void makeDot(uint8_t *position)
+void makeDot(uint8_t *position, bool refresh=true)
   {
   display.fillCircle(*position,SCREEN_HEIGHT-DOT_RADIUS*2,DOT_RADIUS,WHITE);
-  display.display();
+  if (refresh)
+    display.display();
   *position+=DOT_RADIUS*2+DOT_SPACING;
   }
 
+/*
+ * One pass of waiting on the radio: check for serial input, keep the radio
+ * moving, and add a progress dot to the display every so often.
+ */
+void radioWaitStep(uint8_t* dotPosition, unsigned long* nextDot)
+  {
+  checkForCommand();
+  lora.service();
+  if (settings.displayenabled && millis()>=*nextDot && *dotPosition<SCREEN_WIDTH)
+    {
+    makeDot(dotPosition);
+    *nextDot=millis()+RADIO_DOT_INTERVAL;
+    }
+  delay(1);
+  }
+
 /*
  * This returns the elapsed milliseconds, even if we've been sleeping
  */
@@ -697,43 +1149,95 @@ unsigned long myMillis()
   return millis()+myRtc.rtc;
   }
 
-// Read the distance SAMPLE_COUNT times and return the dominant value
+/*
+ * Take samples until enough of them agree, or SAMPLE_COUNT of them have
+ * been taken. Agreeing samples are averaged; if they never agree the
+ * median is used. A first range that matches the last measurement cuts
+ * all of that short.
+ */
 int measure()
   {
   int vals[SAMPLE_COUNT];
-  int answer=0,answerCount=0;
+  int taken=0;
+  int answer=0;
+  bool agreed=false;
+  int needed=constrain(settings.consensusCount,1,SAMPLE_COUNT);
   uint8_t dotPosition=DOT_RADIUS; //where to start drawing the sampling dots
 
-  //get samples
-  for (int i=0;i<SAMPLE_COUNT;i++)
+  //Most wakes find the box as it was. If a single range lands where the last
+  //measurement did, that's good enough.
+  if (settings.quickCheck && myRtc.quickValid)
     {
     makeDot(&dotPosition);
-    vals[i]=getDistance();
-
-    // Turn off the LED
+    vals[0]=getDistance();
     digitalWrite(LED_BUILTIN,LED_OFF);
-    
-    delay(50); //give it some space
+    if (vals[0]>=0 && abs(vals[0]-myRtc.lastDistance)<=myRtc.lastSpread+QUICK_CHECK_MARGIN)
+      {
+      if (settings.debug)
+        Serial.println("Quick check matches the last measurement");
+      return vals[0];
+      }
+    if (vals[0]>=0)
+      taken=1; //it doesn't match, but it's still a good sample
+    }
+
+  if (settings.continuousRanging)
+    {
+    //Draw all of the dots at once, since the samples come faster than the display can keep up
+    for (int i=taken;i<SAMPLE_COUNT;i++)
+      makeDot(&dotPosition,false);
+    display.display();
+    rangeReady=false;
+    sensor.startContinuous(0); //back to back, as fast as the timing budget allows
     }
 
-  //find the most common value within the sample set
-  //This code is not very efficient but hey, it's only 5 values
-  for (int i=0;i<SAMPLE_COUNT-1;i++) //using SAMPLE_COUNT-1 here because the last one can only have a count of 1
+  //get samples
+  while (taken<SAMPLE_COUNT && !agreed)
     {
-    int candidate=vals[i];
-    int candidateCount=1;  
-    for (int j=i+1;j<SAMPLE_COUNT;j++)
+    if (settings.continuousRanging)
+      vals[taken]=getContinuousDistance();
+    else
       {
-      if (candidate==vals[j])
-        {
-        candidateCount++;
-        }
+      if (taken>0)
+        delay(50); //give it some space
+      makeDot(&dotPosition);
+      vals[taken]=getDistance();
+
+      // Turn off the LED
+      digitalWrite(LED_BUILTIN,LED_OFF);
       }
-    if (candidateCount>answerCount)
+    taken++;
+    agreed=findConsensus(vals,taken,needed,settings.consensusTolerance,&answer);
+    }
+
+  if (settings.continuousRanging)
+    {
+    sensor.stopContinuous();
+    digitalWrite(LED_BUILTIN,LED_OFF);
+    }
+
+  //Remember an agreed measurement for the next wake's quick check
+  myRtc.quickValid=agreed && answer>0;
+  if (myRtc.quickValid)
+    {
+    int spread=0;
+    for (int i=0;i<taken;i++)
       {
-      answer=candidate;
-      answerCount=candidateCount;
+      if (abs(vals[i]-answer)<=settings.consensusTolerance)
+        spread=max(spread,abs(vals[i]-answer));
       }
+    myRtc.lastDistance=answer;
+    myRtc.lastSpread=spread;
+    }
+
+  if (!agreed)
+    answer=median(vals,taken);
+
+  if (settings.debug)
+    {
+    Serial.print(taken);
+    Serial.print(" samples, ");
+    Serial.println(agreed?"agreed":"no agreement, using the median");
     }
   return answer;
   }
@@ -760,6 +1264,42 @@ void showSettings()
   Serial.print("invertdisplay=1|0 (");
   Serial.print(settings.invertdisplay);
   Serial.println(")");
+  Serial.print("continuousranging=1|0 <take samples back to back> (");
+  Serial.print(settings.continuousRanging);
+  Serial.println(")");
+  Serial.print("tolerance=<mm between samples that agree> (");
+  Serial.print(settings.consensusTolerance);
+  Serial.println(")");
+  Serial.print("agree=<samples that must agree, 1-");
+  Serial.print(SAMPLE_COUNT);
+  Serial.print("> (");
+  Serial.print(settings.consensusCount);
+  Serial.println(")");
+  Serial.print("quickcheck=1|0 <accept one range that matches the last measurement> (");
+  Serial.print(settings.quickCheck);
+  Serial.println(")");
+  Serial.print("sensorinterrupt=<GPIO0-5 or 12-15 wired to the sensor's GPIO1, -1 to poll> (");
+  Serial.print(settings.sensorInterruptPin);
+  Serial.println(")");
+  Serial.print("timingbudget=<microseconds per range, 20000 and up> (");
+  Serial.print(settings.timingBudget);
+  Serial.println(")");
+  Serial.print("vcselprerange=<pre-range pulse period, even 12-18> (");
+  Serial.print(settings.vcselPreRange);
+  Serial.println(")");
+  Serial.print("vcselfinalrange=<final range pulse period, even 8-14> (");
+  Serial.print(settings.vcselFinalRange);
+  Serial.println(")");
+  Serial.print("signalratelimit=<weakest return to range, in MCPS> (");
+  Serial.print(settings.signalRateLimit);
+  Serial.println(")");
+  Serial.print("rangingprofile=");
+  for (unsigned int p=0;p<RANGING_PROFILE_COUNT;p++)
+    {
+    Serial.print(p?"|":"");
+    Serial.print(rangingProfiles[p].name);
+    }
+  Serial.println(" <sets the four above at once>");
   Serial.print("loRaTargetAddress=<Target LoRa module's address 0-65535> (");
   Serial.print(settings.loRaTargetAddress);
   Serial.println(")");
@@ -790,10 +1330,25 @@ void showSettings()
   Serial.print("loRaPower=<RF power in dbm> (");
   Serial.print(settings.loRaPower);
   Serial.println(")");
+  Serial.print("adr=1|0 <adapt RF power to the link> (");
+  Serial.print(settings.adr);
+  Serial.print(", now ");
+  Serial.print(loraPower());
+  Serial.println(" dBm)");
+  Serial.print("lbt=1|0 <listen before sending; only hears traffic to this node or broadcast, not other nodes' reports> (");
+  Serial.print(settings.lbt);
+  Serial.println(")");
+
+  Serial.print("\nEach report takes about ");
+  Serial.print(airtime(LORA_REPORT_TEXT_LENGTH));
+  Serial.println(" ms on the air at these settings.");
 
   Serial.println("\n*** Use NULL to reset a setting to its default value ***");
   Serial.println("*** Use \"factorydefaults=yes\" to reset all settings  ***");
-  Serial.println("*** Use \"lorasettings=yes\" to show internal RYLR998 settings  ***\n");
+  Serial.println("*** Use \"lorasettings=yes\" to show internal RYLR998 settings  ***");
+  Serial.println("*** Use \"lorastats=yes\" to show RYLR998 timing and error counts  ***");
+  Serial.println("*** Use \"lorabench=<rounds>\" to measure CPU per byte and errors on the RYLR998 link  ***");
+  Serial.println("*** Use \"sweep=yes\" to compare the ranging profiles  ***\n");
   
   Serial.print("\nSettings are ");
   Serial.println(settingsAreValid?"complete.":"incomplete.");
@@ -895,7 +1450,7 @@ bool processCommand(String cmd)
         strcpy(val,"0");
       settings.loRaAddress=atoi(val);
       saveSettings();
-      lora.setAddress(settings.loRaAddress);
+      loraSettingSaved();
       }
     else if (strcmp(nme,"loRaBand")==0)
       {
@@ -903,7 +1458,7 @@ bool processCommand(String cmd)
         strcpy(val,"0");
       settings.loRaBand=atoi(val);
       saveSettings();
-      lora.setBand(settings.loRaBand);
+      loraSettingSaved();
       }
     else if (strcmp(nme,"loRaBandwidth")==0)
       {
@@ -911,7 +1466,7 @@ bool processCommand(String cmd)
         strcpy(val,"0");
       settings.loRaBandwidth=atoi(val);
       saveSettings();
-      setLoRaParameters();
+      loraSettingSaved();
       }
     else if (strcmp(nme,"loRaCodingRate")==0)
       {
@@ -919,7 +1474,7 @@ bool processCommand(String cmd)
         strcpy(val,"0");
       settings.loRaCodingRate=atoi(val);
       saveSettings();
-      setLoRaParameters();
+      loraSettingSaved();
       }
     else if (strcmp(nme,"loRaNetworkID")==0)
       {
@@ -927,7 +1482,7 @@ bool processCommand(String cmd)
         strcpy(val,"0");
       settings.loRaNetworkID=atoi(val);
       saveSettings();
-      lora.setNetworkID(settings.loRaNetworkID);
+      loraSettingSaved();
       }
     else if (strcmp(nme,"loRaSpreadingFactor")==0)
       {
@@ -935,7 +1490,7 @@ bool processCommand(String cmd)
         strcpy(val,"0");
       settings.loRaSpreadingFactor=atoi(val);
       saveSettings();
-      setLoRaParameters();
+      loraSettingSaved();
       }
     else if (strcmp(nme,"loRaPreamble")==0)
       {
@@ -943,15 +1498,22 @@ bool processCommand(String cmd)
         strcpy(val,"0");
       settings.loRaPreamble=atoi(val);
       saveSettings();
-      setLoRaParameters();
+      loraSettingSaved();
       }
     else if (strcmp(nme,"loRaBaudRate")==0)
       {
       if (!val)
         strcpy(val,"0");
+      long oldRate=settings.loRaBaudRate;
       settings.loRaBaudRate=atoi(val);
       saveSettings();
-      lora.setBaudRate(settings.loRaBaudRate);
+
+      //unlike the others this can't wait for the next report, since the
+      //module has to be told before we change our end of the link
+      loraRadio(LORA_ON);
+      if (lora.begin(oldRate))
+        lora.setBaudRate(settings.loRaBaudRate);
+      loraRadio(LORA_OFF);
 
       //this affects the baud rate of the software serial connection
       //so we need to reboot
@@ -964,8 +1526,9 @@ bool processCommand(String cmd)
       if (!val)
         strcpy(val,"0");
       settings.loRaPower=atoi(val);
+      myRtc.adrPower=settings.loRaPower; //ADR starts over from the new power
       saveSettings();
-      lora.setRFPower(settings.loRaPower);
+      loraSettingSaved();
       }
     else if (strcmp(nme,"debug")==0)
       {
@@ -975,6 +1538,139 @@ bool processCommand(String cmd)
       lora.setdebug(settings.debug);
       saveSettings();
       }
+    else if (strcmp(nme,"adr")==0)
+      {
+      if (!val)
+        strcpy(val,"0");
+      settings.adr=atoi(val)==1?true:false;
+      myRtc.adrPower=settings.loRaPower;
+      saveSettings();
+      loraSettingSaved();
+      }
+    else if (strcmp(nme,"continuousranging")==0)
+      {
+      if (!val)
+        strcpy(val,"0");
+      settings.continuousRanging=atoi(val)==1?true:false;
+      saveSettings();
+      }
+    else if (strcmp(nme,"tolerance")==0)
+      {
+      if (!val)
+        strcpy(val,"10");
+      settings.consensusTolerance=atoi(val);
+      saveSettings();
+      }
+    else if (strcmp(nme,"agree")==0)
+      {
+      if (!val)
+        strcpy(val,"3");
+      settings.consensusCount=constrain(atoi(val),1,SAMPLE_COUNT);
+      saveSettings();
+      }
+    else if (strcmp(nme,"quickcheck")==0)
+      {
+      if (!val)
+        strcpy(val,"0");
+      settings.quickCheck=atoi(val)==1?true:false;
+      saveSettings();
+      }
+    else if (strcmp(nme,"sensorinterrupt")==0)
+      {
+      if (!val)
+        strcpy(val,"-1");
+      if (!validInterruptPin(atoi(val)))
+        Serial.println("That pin can't take an interrupt. Use GPIO0-5 or 12-15, or -1 to poll.");
+      else
+        {
+        if (settings.sensorInterruptPin>=0)
+          detachInterrupt(digitalPinToInterrupt(settings.sensorInterruptPin));
+        settings.sensorInterruptPin=atoi(val);
+        saveSettings();
+        attachSensorInterrupt();
+        }
+      }
+    else if (strcmp(nme,"timingbudget")==0)
+      {
+      if (!val)
+        strcpy(val,"33000");
+      if (!validTimingBudget(atol(val)))
+        Serial.println("The timing budget must be 20000 to 1000000 microseconds.");
+      else
+        {
+        settings.timingBudget=atol(val);
+        saveSettings();
+        applySensorSettings();
+        }
+      }
+    else if (strcmp(nme,"vcselprerange")==0)
+      {
+      if (!val)
+        strcpy(val,"14");
+      if (!validVcselPreRange(atoi(val)))
+        Serial.println("The pre-range pulse period must be 12, 14, 16 or 18.");
+      else
+        {
+        settings.vcselPreRange=atoi(val);
+        saveSettings();
+        applySensorSettings();
+        }
+      }
+    else if (strcmp(nme,"vcselfinalrange")==0)
+      {
+      if (!val)
+        strcpy(val,"10");
+      if (!validVcselFinalRange(atoi(val)))
+        Serial.println("The final range pulse period must be 8, 10, 12 or 14.");
+      else
+        {
+        settings.vcselFinalRange=atoi(val);
+        saveSettings();
+        applySensorSettings();
+        }
+      }
+    else if (strcmp(nme,"signalratelimit")==0)
+      {
+      if (!val)
+        strcpy(val,"0.25");
+      if (!validSignalRateLimit(atof(val)))
+        Serial.println("The signal rate limit must be 0 to 511.99 MCPS.");
+      else
+        {
+        settings.signalRateLimit=atof(val);
+        saveSettings();
+        applySensorSettings();
+        }
+      }
+    else if (strcmp(nme,"rangingprofile")==0)
+      {
+      unsigned int p=0;
+      while (p<RANGING_PROFILE_COUNT && strcmp(val,rangingProfiles[p].name)!=0)
+        p++;
+      if (p==RANGING_PROFILE_COUNT)
+        {
+        showSettings();
+        commandFound=false; //no such profile
+        }
+      else
+        {
+        settings.timingBudget=rangingProfiles[p].timingBudget;
+        settings.vcselPreRange=rangingProfiles[p].vcselPreRange;
+        settings.vcselFinalRange=rangingProfiles[p].vcselFinalRange;
+        settings.signalRateLimit=rangingProfiles[p].signalRateLimit;
+        saveSettings();
+        applySensorSettings();
+        }
+      }
+    else if ((strcmp(nme,"sweep")==0) && (strcmp(val,"yes")==0))
+      sweepRangingProfiles();
+    else if (strcmp(nme,"lbt")==0)
+      {
+      if (!val)
+        strcpy(val,"0");
+      settings.lbt=atoi(val)==1?true:false;
+      saveSettings();
+      }
     else if ((strcmp(nme,"factorydefaults")==0) && (strcmp(val,"yes")==0)) //reset all eeprom settings
       {
       Serial.println("\n*********************** Resetting EEPROM Values ************************");
@@ -987,6 +1683,37 @@ bool processCommand(String cmd)
       {
       showLoraSettings();
       }
+    else if ((strcmp(nme,"lorastats")==0) && (strcmp(val,"yes")==0)) //show radio statistics
+      {
+      Serial.println("\n*** RYLR998 command statistics ***");
+      lora.printStats(Serial);
+      Serial.print("Collisions ");
+      Serial.print(myRtc.collisions);
+      Serial.print(", retries ");
+      Serial.print(myRtc.retries);
+      Serial.print(", busy channel ");
+      Serial.println(myRtc.busyChannel);
+      Serial.print("Ack round trip (ms): last ");
+      Serial.print(myRtc.lastAckRtt);
+      Serial.print(", min ");
+      Serial.print(myRtc.minAckRtt==0xFFFF?0:myRtc.minAckRtt);
+      Serial.print(", max ");
+      Serial.println(myRtc.maxAckRtt);
+      }
+    else if (strcmp(nme,"lorabench")==0) //time the link to the RYLR998
+      {
+      int rounds=val?atoi(val):0;
+      if (rounds<1)
+        rounds=LORA_BENCH_ROUNDS;
+      Serial.println("\n*** RYLR998 link benchmark ***");
+      if (reporting)
+        Serial.println("The radio is busy with a report, try again in a moment.");
+      else if (initLoRa())
+        {
+        lora.benchmarkLink(Serial,rounds);
+        loraRadio(LORA_OFF);
+        }
+      }
     else if (strcmp(nme,"displayenabled")==0)
       {
       if (!val)
@@ -1029,6 +1756,17 @@ void initializeSettings()
   settings.loRaPreamble=DEFAULT_LORA_PREAMBLE;
   settings.loRaBaudRate=DEFAULT_LORA_BAUD_RATE;
   settings.loRaPower=DEFAULT_LORA_POWER;
+  settings.adr=true;
+  settings.lbt=false;
+  settings.continuousRanging=true;
+  settings.timingBudget=DEFAULT_TIMING_BUDGET;
+  settings.vcselPreRange=DEFAULT_VCSEL_PRE_RANGE;
+  settings.vcselFinalRange=DEFAULT_VCSEL_FINAL_RANGE;
+  settings.signalRateLimit=DEFAULT_SIGNAL_RATE_LIMIT;
+  settings.consensusTolerance=DEFAULT_CONSENSUS_TOLERANCE;
+  settings.consensusCount=DEFAULT_CONSENSUS_COUNT;
+  settings.quickCheck=true;
+  settings.sensorInterruptPin=-1;
   }
 
 void checkForCommand()
@@ -1055,6 +1793,11 @@ int readBattery()
   return raw;
   }
 
+int convertToMillivolts(int raw)
+  {
+  return map(raw,0,FULL_BATTERY_COUNT,0,FULL_BATTERY_VOLTS)*10;
+  }
+
 float convertToVoltage(int raw)
   {
   int vcc=map(raw,0,FULL_BATTERY_COUNT,0,FULL_BATTERY_VOLTS);
@@ -1070,39 +1813,168 @@ float convertToVoltage(int raw)
  ************************/
 bool report()
   {
-  initLoRa(); //fire up the radio
-  doc["distance"]=distance;
-  doc["battery"]=(float)convertToVoltage(readBattery());
-  doc["isPresent"]=isPresent;
+  //A report that wasn't acked keeps its number when we send it again, so the
+  //receiver can tell a repeat from a new event
+  if (myRtc.acked || isPresent!=myRtc.sequencePresent)
+    {
+    myRtc.sequence++;
+    myRtc.sequencePresent=isPresent;
+    }
+
+  //Boxes wake on much the same schedule. Seed from our address so that they
+  //pick different backoffs, and from the sequence so one box doesn't pick the
+  //same one every time.
+  randomSeed(((unsigned long)settings.loRaAddress<<16)^myRtc.sequence^((unsigned long)myRtc.missedAcks<<24));
+  if (!myRtc.acked)
+    {
+    //The last report collided or got lost, so don't go straight back to the
+    //same slot as whoever it collided with. Wait with the radio still off.
+    myRtc.retries++;
+    backoff(myRtc.missedAcks);
+    }
+  if (!initLoRa()) //fire up the radio
+    {
+    Serial.println("Sending data failed!");
+    myRtc.acked=false; //so we try again on the next wake
+    return false;
+    }
+  if (settings.lbt)
+    {
+    for (int i=0;i<LBT_MAX_TRIES && !lora.channelClear(airtime(LORA_REPORT_TEXT_LENGTH));i++)
+      {
+      myRtc.busyChannel++;
+      backoff(i);
+      }
+    }
   myRtc.acked=false; //no ack yet
-  if (publish())
+  reporting=true;
+  uint8_t dotPosition=DOT_RADIUS; //progress dots along the bottom while the radio works
+  unsigned long nextDot=0;
+  unsigned long sent=0;
+  LoraResult result=LORA_QUEUE_FULL;
+  for (int attempt=1;attempt<=LORA_MAX_ATTEMPTS;attempt++)
+    {
+    //The send is only queued, so the console and the display keep going while it goes out
+    sent=millis();
+    int handle=publish();
+    if (handle<0)
+      break;
+    while (!lora.isComplete(handle))
+      radioWaitStep(&dotPosition,&nextDot);
+    result=lora.getResult(handle);
+    lora.release(handle);
+    if (result!=LORA_ERR_TX_BUSY)
+      break;
+    myDelay(LORA_TX_BUSY_WAIT); //the module hasn't finished its last transmission
+    }
+  if (result==LORA_OK)
     {
     Serial.println("Sending data successful.");
-    for (int i=0;i<5;i++)
+
+    //Give the report time to go out, the receiver time to answer, and the ack time to come back
+    //The gateway's turnaround hasn't been measured yet (see lorastats), so keep
+    //at least the old window. An ack that comes sooner still ends the wait.
+    unsigned long ackWait=lastAirtime+airtime(ACK_PAYLOAD_SIZE)+ACK_TURNAROUND_TIME;
+    ackWait=max(ackWait,(unsigned long)ACK_MIN_WAIT);
+    while (!myRtc.acked && millis()-sent<ackWait)
+      {
+      if (lora.handleIncoming())
+        checkForAck();
+      else
+        radioWaitStep(&dotPosition,&nextDot);
+      }
+    loraRadio(LORA_OFF); //nothing else is coming, turn off the radio
+    if (myRtc.acked)
       {
-    //  Serial.println("handleIncoming loop "+String(i));
-      lora.handleIncoming(); //check for ack
-      checkForAck();
-      if (myRtc.acked)
+      myRtc.batchCount=0; //the buffered readings got there
+      myRtc.lastAckRtt=millis()-sent;
+      myRtc.minAckRtt=min(myRtc.minAckRtt,myRtc.lastAckRtt);
+      myRtc.maxAckRtt=max(myRtc.maxAckRtt,myRtc.lastAckRtt);
+      if (settings.debug)
         {
-        loraRadio(LORA_OFF); //turn off the radio
-        break;
+        Serial.print("Ack came back in ");
+        Serial.print(myRtc.lastAckRtt);
+        Serial.print("ms of ");
+        Serial.print(ackWait);
+        Serial.println("ms allowed");
         }
-      delay(500);
       }
     }
 
   else
-    Serial.println("Sending data failed!");
+    {
+    Serial.print("Sending data failed with result ");
+    Serial.println(result);
+    }
+  reporting=false;
+  if (myRtc.acked)
+    myRtc.missedAcks=0;
+  else
+    {
+    myRtc.collisions++;
+    if (myRtc.missedAcks<255)
+      myRtc.missedAcks++;
+    }
+  adaptDataRate();
   return myRtc.acked;
   }
 
-boolean publish()
+/*
+ * Wait a random number of backoff slots, up to 2^exponent of them, so that
+ * senders that just collided don't collide again.
+ */
+void backoff(uint8_t exponent)
+  {
+  unsigned long wait=random(backoffSlots(exponent))*BACKOFF_SLOT;
+  if (settings.debug)
+    {
+    Serial.print("Backing off for ");
+    Serial.print(wait);
+    Serial.println(" ms");
+    }
+  myDelay(wait);
+  }
+
+// Queue the current reading as a compact binary frame, returning the send's
+// handle or -1. The receiver turns it back into {"distance":...,"battery":...,"isPresent":...}.
+int publish()
   {
-  String json;
-  serializeJson(doc,json);
-  Serial.println("Publishing "+json);
-  return lora.send(settings.loRaTargetAddress, json);
+  static char text[LORA_FRAME_TEXT_SIZE]; //static so nothing lands on the heap
+  ReportFrame report;
+  report.flags=isPresent?LORA_FLAG_PRESENT:0;
+  report.sequence=myRtc.sequence;
+  report.distance=(distance<0 || distance>=LORA_DISTANCE_INVALID)?LORA_DISTANCE_INVALID:distance;
+  report.batteryMv=convertToMillivolts(readBattery());
+
+  //add whatever we buffered while nothing was worth reporting
+  unsigned long now=myMillis()/1000;
+  report.readingCount=myRtc.batchCount;
+  for (int i=0;i<myRtc.batchCount;i++)
+    {
+    const BufferedReading& reading=myRtc.batch[(myRtc.batchStart+i)%LORA_MAX_BATCH];
+    report.readings[i].age=min(now-reading.time,0xFFFFul);
+    report.readings[i].distance=reading.distance;
+    report.readings[i].batteryMv=reading.batteryMv;
+    }
+  size_t len=RYLR998::encodeReport(report,text,sizeof(text));
+  lastAirtime=airtime(len);
+
+  Serial.print("Publishing ");
+  Serial.print(text);
+  Serial.print(" (distance=");
+  Serial.print(distance);
+  Serial.print(", battery=");
+  Serial.print(report.batteryMv);
+  Serial.print("mV, present=");
+  Serial.print(isPresent);
+  Serial.print(", seq=");
+  Serial.print(report.sequence);
+  Serial.print(", ");
+  Serial.print(report.readingCount);
+  Serial.print(" buffered, ~");
+  Serial.print(lastAirtime);
+  Serial.println("ms on air)");
+  return lora.queueSend(settings.loRaTargetAddress, (const uint8_t*)text, len);
   }
 
   
@@ -1115,6 +1987,11 @@ void loadSettings()
   if (settings.validConfig==VALID_SETTINGS_FLAG)    //skip loading stuff if it's never been written
     {
     settingsAreValid=true;
+    if (fixNewSettings())
+      {
+      Serial.println("Filled in settings added since the last save");
+      saveSettings();
+      }
     if (settings.debug)
       {
       Serial.println("Loaded configuration values from EEPROM");
@@ -1128,6 +2005,82 @@ void loadSettings()
     }
   }
 
+// True if a stored bool holds something other than 0 or 1, like erased flash
+bool badBool(const bool& value)
+  {
+  uint8_t raw;
+  memcpy(&raw,&value,1);
+  return raw>1;
+  }
+
+/*
+ * Settings added to the end of the struct were never written by older
+ * firmware, so they load as whatever was in the flash, usually 0xFF bytes.
+ * Put any that are out of range back to their defaults. Returns true if
+ * anything changed.
+ */
+bool fixNewSettings()
+  {
+  conf defaults;
+  bool fixed=false;
+  if (badBool(settings.adr))
+    {
+    settings.adr=defaults.adr;
+    fixed=true;
+    }
+  if (badBool(settings.lbt))
+    {
+    settings.lbt=defaults.lbt;
+    fixed=true;
+    }
+  if (badBool(settings.continuousRanging))
+    {
+    settings.continuousRanging=defaults.continuousRanging;
+    fixed=true;
+    }
+  if (!validTimingBudget(settings.timingBudget))
+    {
+    settings.timingBudget=defaults.timingBudget;
+    fixed=true;
+    }
+  if (!validVcselPreRange(settings.vcselPreRange))
+    {
+    settings.vcselPreRange=defaults.vcselPreRange;
+    fixed=true;
+    }
+  if (!validVcselFinalRange(settings.vcselFinalRange))
+    {
+    settings.vcselFinalRange=defaults.vcselFinalRange;
+    fixed=true;
+    }
+  if (!validSignalRateLimit(settings.signalRateLimit))
+    {
+    settings.signalRateLimit=defaults.signalRateLimit;
+    fixed=true;
+    }
+  if (settings.consensusTolerance<0 || settings.consensusTolerance>MAX_DIST)
+    {
+    settings.consensusTolerance=defaults.consensusTolerance;
+    fixed=true;
+    }
+  if (settings.consensusCount<1 || settings.consensusCount>SAMPLE_COUNT)
+    {
+    settings.consensusCount=defaults.consensusCount;
+    fixed=true;
+    }
+  if (badBool(settings.quickCheck))
+    {
+    settings.quickCheck=defaults.quickCheck;
+    fixed=true;
+    }
+  if (!validInterruptPin(settings.sensorInterruptPin))
+    {
+    settings.sensorInterruptPin=defaults.sensorInterruptPin;
+    fixed=true;
+    }
+  return fixed;
+  }
+
 /*
  * Save the settings to EEPROM. Set the valid flag if everything is filled in.
  */
@@ -1155,6 +2108,7 @@ boolean saveSettings()
  */
 void saveRTC()
   {
+  myRtc.loraStats=lora.getStats();
   system_rtc_mem_write(64, &myRtc, sizeof(myRtc)); 
   }
 
@@ -0,0 +1,114 @@
+/*
+ * Just enough of the Arduino core to build the RYLR998 driver on the host
+ * for the [env:native] tests. Time is simulated: millis() only moves when
+ * yield() or delay() is called, or when a test moves nativeMillis itself,
+ * so anything that spins waiting for the module shows up as time blocked.
+ */
+
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <algorithm>
+#include <string>
+
+using std::min;
+using std::max;
+
+#define F(x) (x)
+#define PROGMEM
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+inline unsigned long nativeMillis=0;
+
+inline unsigned long millis() { return nativeMillis; }
+inline unsigned long micros() { return nativeMillis*1000; }
+inline void delay(unsigned long ms) { nativeMillis+=ms; }
+inline void yield() { nativeMillis++; }
+
+class String
+    {
+    public:
+        String(const char* s="") : _s(s?s:"") {}
+        String(char c) : _s(1, c) {}
+        String(int n) : _s(std::to_string(n)) {}
+        String(unsigned int n) : _s(std::to_string(n)) {}
+        String(long n) : _s(std::to_string(n)) {}
+        String(unsigned long n) : _s(std::to_string(n)) {}
+        unsigned int length() const { return _s.length(); }
+        const char* c_str() const { return _s.c_str(); }
+        String& operator+=(const String& other) { _s+=other._s; return *this; }
+        friend String operator+(const String& a, const String& b) { String r(a); r+=b; return r; }
+        friend String operator+(const char* a, const String& b) { return String(a)+b; }
+        friend String operator+(const String& a, const char* b) { return a+String(b); }
+        bool operator==(const char* other) const { return _s==other; }
+
+    private:
+        std::string _s;
+    };
+
+class Print
+    {
+    public:
+        virtual ~Print() {}
+        virtual size_t write(uint8_t c)=0;
+        virtual size_t write(const uint8_t* buffer, size_t size)
+            {
+            for (size_t i=0;i<size;i++)
+                write(buffer[i]);
+            return size;
+            }
+        size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+        size_t print(const char* s) { return write(s); }
+        size_t print(const String& s) { return write(s.c_str()); }
+        size_t print(char c) { return write((uint8_t)c); }
+        size_t print(long n) { return write(String(n).c_str()); }
+        size_t print(int n) { return print((long)n); }
+        size_t print(unsigned long n) { return write(String(n).c_str()); }
+        size_t print(unsigned int n) { return print((unsigned long)n); }
+        size_t println() { return write("\r\n"); }
+        template<typename T> size_t println(const T& value) { return print(value)+println(); }
+        size_t printf(const char* format, ...)
+            {
+            char buffer[256];
+            va_list args;
+            va_start(args, format);
+            int len=vsnprintf(buffer, sizeof(buffer), format, args);
+            va_end(args);
+            return len>0?write(buffer):0;
+            }
+        virtual void flush() {}
+    };
+
+class Stream : public Print
+    {
+    public:
+        virtual int available()=0;
+        virtual int read()=0;
+        virtual int peek()=0;
+    };
+
+// Console output is thrown away so it doesn't get mixed into the test results
+class HardwareSerial : public Stream
+    {
+    public:
+        void begin(unsigned long) {}
+        void swap() {}
+        int available() override { return 0; }
+        int read() override { return -1; }
+        int peek() override { return -1; }
+        size_t write(uint8_t) override { return 1; }
+        using Print::write;
+    };
+
+inline HardwareSerial Serial;
+
+#endif // NATIVE_ARDUINO_H
@@ -0,0 +1,130 @@
+/*
+ * A stand-in for the RYLR998's UART. The test scripts the replies: each
+ * command the driver writes is matched against the next expected one, and
+ * its reply comes back after the given latency in simulated time. Lines the
+ * module sends on its own, like +RCV, can be injected at any time. Like a
+ * real UART it can be given a receive buffer size, and whatever arrives while
+ * that buffer is full is lost.
+ */
+
+#ifndef SCRIPTED_UART_H
+#define SCRIPTED_UART_H
+
+#include <Arduino.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+class ScriptedUart : public Stream
+    {
+    public:
+        // Answer the next command written, if it starts with command, latency ms later
+        void expect(const char* command, const char* reply, unsigned long latency)
+            {
+            _expected.push_back({command, std::string(reply)+"\r\n", latency});
+            }
+
+        // Raw bytes from the module, arriving at the given time. Include the line ending.
+        void inject(const char* text, unsigned long at)
+            {
+            auto it=_incoming.begin();
+            while (it!=_incoming.end() && it->due<=at)
+                ++it;
+            _incoming.insert(it, {at, text});
+            }
+
+        // Bytes the receive buffer holds before it starts losing them, 0 for no limit
+        void setCapacity(size_t capacity) { _capacity=capacity; }
+
+        // Bytes that arrived with the receive buffer full
+        size_t lost() { return _lost; }
+
+        // Every line the driver has written, without its line ending
+        const std::vector<std::string>& sent() { return _sent; }
+
+        // Commands that didn't match what was expected, or weren't expected at all
+        int unexpected() { return _unexpected; }
+
+        int available() override
+            {
+            _receive();
+            return _fifo.size();
+            }
+
+        int read() override
+            {
+            if (!available())
+                return -1;
+            char c=_fifo.front();
+            _fifo.pop_front();
+            return (uint8_t)c;
+            }
+
+        int peek() override
+            {
+            return available()?(uint8_t)_fifo.front():-1;
+            }
+
+        size_t write(uint8_t c) override
+            {
+            if (c=='\n')
+                _endLine();
+            else if (c!='\r')
+                _line+=(char)c;
+            return 1;
+            }
+        using Print::write;
+
+    private:
+        typedef struct
+            {
+            std::string command;
+            std::string reply;
+            unsigned long latency;
+            } Expected;
+        typedef struct
+            {
+            unsigned long due;
+            std::string text;
+            } Incoming;
+
+        std::deque<Expected> _expected;
+        std::deque<Incoming> _incoming;
+        std::deque<char> _fifo;     // arrived, not read yet
+        size_t _capacity=0;
+        size_t _lost=0;
+        std::string _line;          // the command being written
+        std::vector<std::string> _sent;
+        int _unexpected=0;
+
+        // Move everything that has arrived by now into the receive buffer
+        void _receive()
+            {
+            while (!_incoming.empty() && _incoming.front().due<=millis())
+                {
+                for (char c : _incoming.front().text)
+                    {
+                    if (_capacity && _fifo.size()>=_capacity)
+                        _lost++;
+                    else
+                        _fifo.push_back(c);
+                    }
+                _incoming.pop_front();
+                }
+            }
+
+        void _endLine()
+            {
+            _sent.push_back(_line);
+            if (!_expected.empty() && _line.compare(0, _expected.front().command.length(), _expected.front().command)==0)
+                {
+                inject(_expected.front().reply.c_str(), millis()+_expected.front().latency);
+                _expected.pop_front();
+                }
+            else
+                _unexpected++;
+            _line.clear();
+            }
+    };
+
+#endif // SCRIPTED_UART_H
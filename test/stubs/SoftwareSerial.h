@@ -0,0 +1,26 @@
+// The host tests talk to the driver through a Stream, so this never carries
+// anything. It only remembers the rates it was opened at.
+#ifndef NATIVE_SOFTWARESERIAL_H
+#define NATIVE_SOFTWARESERIAL_H
+
+#include <Arduino.h>
+#include <vector>
+
+#define SWSERIAL_8N1 0
+
+class SoftwareSerial : public Stream
+    {
+    public:
+        SoftwareSerial(int, int, bool=false) {}
+        void begin(long baud, int=SWSERIAL_8N1, int=-1, int=-1, bool=false, int=64, int=0) { opened.push_back(baud); }
+        void end() {}
+        int available() override { return 0; }
+        int read() override { return -1; }
+        int peek() override { return -1; }
+        size_t write(uint8_t) override { return 1; }
+        using Print::write;
+
+        inline static std::vector<long> opened;
+    };
+
+#endif // NATIVE_SOFTWARESERIAL_H
@@ -0,0 +1,120 @@
+/*
+ * Many nodes reporting on the same schedule, simulated with the randomized
+ * exponential backoff report() uses after a missed ack, and without it.
+ * Their wakes fall within a couple of seconds of each other, as they do
+ * when the boxes were all started together.
+ * Build and run with: pio test -e native
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <RYLR998.h>
+#include "delivery_reporter_lora.h"
+
+// The node's default radio settings: SF8, 125kHz, 4/5, preamble 12
+#define SF 8
+#define BW 7
+#define CR 1
+#define PREAMBLE 12
+
+#define MAX_NODES 50
+#define WAKES 1000
+#define WAKE_SPREAD 2000    // ms, how far apart the nodes' clocks put their wakes
+#define WAKE_JITTER 50      // ms, how much a wake moves from one to the next
+
+static const int nodeCounts[]={5, 10, 20, 50};
+#define NODE_COUNTS (int)(sizeof(nodeCounts)/sizeof(nodeCounts[0]))
+
+void setUp() {}
+void tearDown() {}
+
+static uint32_t nextRandom(uint32_t& state)
+    {
+    state=state*1103515245+12345;
+    return (state>>16) & 0x7FFF;
+    }
+
+typedef struct
+    {
+    double collisionRate;   // reports that overlapped another on air
+    int worstRun;           // most reports in a row one node lost
+    } SimResult;
+
+/*
+ * Every wake each node sends one report, at its own point in the wake
+ * window plus a little jitter. A node that missed its last ack first waits
+ * random(backoffSlots(missedAcks)) slots, as report() does. Reports that
+ * overlap on air are both lost and neither is acked.
+ */
+static SimResult simulate(int nodes, bool useBackoff)
+    {
+    unsigned long air=(loraTimeOnAir(SF, BW, CR, PREAMBLE, LORA_REPORT_TEXT_LENGTH)+999)/1000;
+    uint32_t state=nodes;
+    unsigned long phase[MAX_NODES];
+    uint8_t missedAcks[MAX_NODES]={};
+    unsigned long start[MAX_NODES];
+    for (int n=0;n<nodes;n++)
+        phase[n]=nextRandom(state)%WAKE_SPREAD;
+
+    SimResult result={0, 0};
+    long collided=0;
+    for (int wake=0;wake<WAKES;wake++)
+        {
+        for (int n=0;n<nodes;n++)
+            {
+            start[n]=phase[n]+nextRandom(state)%WAKE_JITTER;
+            if (useBackoff && missedAcks[n])
+                start[n]+=(nextRandom(state)%backoffSlots(missedAcks[n]))*BACKOFF_SLOT;
+            }
+        for (int n=0;n<nodes;n++)
+            {
+            bool hit=false;
+            for (int other=0;other<nodes && !hit;other++)
+                hit=other!=n && start[other]<start[n]+air && start[n]<start[other]+air;
+            if (hit)
+                {
+                collided++;
+                if (missedAcks[n]<255)
+                    missedAcks[n]++;
+                result.worstRun=max(result.worstRun, (int)missedAcks[n]);
+                }
+            else
+                missedAcks[n]=0;
+            }
+        }
+    result.collisionRate=(double)collided/((long)nodes*WAKES);
+    return result;
+    }
+
+static void test_backoff_cuts_collisions()
+    {
+    for (int i=0;i<NODE_COUNTS;i++)
+        {
+        SimResult with=simulate(nodeCounts[i], true);
+        SimResult without=simulate(nodeCounts[i], false);
+        char message[120];
+        snprintf(message, sizeof(message), "%d nodes: backoff %.1f%% collide, worst run %d; no backoff %.1f%% collide, worst run %d",
+                 nodeCounts[i], 100*with.collisionRate, with.worstRun, 100*without.collisionRate, without.worstRun);
+        TEST_MESSAGE(message);
+        TEST_ASSERT_TRUE(with.collisionRate<=without.collisionRate);
+        //nodes whose wakes overlap collide every time unless they back off
+        TEST_ASSERT_TRUE(with.worstRun<without.worstRun || without.worstRun==0);
+        }
+    }
+
+// The window doubles with each miss, up to its limit
+static void test_backoff_window()
+    {
+    TEST_ASSERT_EQUAL_UINT32(1, backoffSlots(0));
+    TEST_ASSERT_EQUAL_UINT32(2, backoffSlots(1));
+    TEST_ASSERT_EQUAL_UINT32(1ul<<BACKOFF_MAX_EXPONENT, backoffSlots(BACKOFF_MAX_EXPONENT));
+    TEST_ASSERT_EQUAL_UINT32(1ul<<BACKOFF_MAX_EXPONENT, backoffSlots(255));
+    }
+
+int main(int argc, char** argv)
+    {
+    UNITY_BEGIN();
+    RUN_TEST(test_backoff_window);
+    RUN_TEST(test_backoff_cuts_collisions);
+    return UNITY_END();
+    }
@@ -0,0 +1,189 @@
+/*
+ * Picking a distance from the samples: findConsensus() and median().
+ * Build and run with: pio test -e native
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include "delivery_reporter_lora.h"
+#include <math.h>
+
+#define TOLERANCE 10
+#define NEEDED 3
+
+void setUp() {}
+void tearDown() {}
+
+// Feed samples one at a time the way measure() does, returning how many it took
+static int sampleUntilAgreed(int* vals, int count, int* answer)
+    {
+    for (int taken=1;taken<=count;taken++)
+        {
+        if (findConsensus(vals, taken, NEEDED, TOLERANCE, answer))
+            return taken;
+        }
+    return 0;
+    }
+
+static void test_steady_samples_agree_early()
+    {
+    int vals[SAMPLE_COUNT]={500, 504, 498, 700, 701};
+    int answer=0;
+    TEST_ASSERT_EQUAL(3, sampleUntilAgreed(vals, SAMPLE_COUNT, &answer));
+    TEST_ASSERT_EQUAL(501, answer);
+    }
+
+// An outlier doesn't pull the average, and doesn't stop the rest agreeing
+static void test_outlier_is_left_out()
+    {
+    int vals[SAMPLE_COUNT]={500, 8190, 505, 495, 0};
+    int answer=0;
+    TEST_ASSERT_EQUAL(4, sampleUntilAgreed(vals, SAMPLE_COUNT, &answer));
+    TEST_ASSERT_EQUAL(500, answer);
+    }
+
+// Samples are within tolerance of a center, not necessarily of each other
+static void test_group_is_measured_from_its_center()
+    {
+    int vals[]={500, 510, 490};
+    int answer=0;
+    TEST_ASSERT_TRUE(findConsensus(vals, 3, NEEDED, TOLERANCE, &answer));
+    TEST_ASSERT_EQUAL(500, answer);
+    int wide[]={480, 500, 521};
+    TEST_ASSERT_FALSE(findConsensus(wide, 3, NEEDED, TOLERANCE, &answer));
+    }
+
+static void test_no_agreement_falls_back_to_the_median()
+    {
+    int vals[SAMPLE_COUNT]={100, 400, 250, 900, 600};
+    int answer=-2;
+    TEST_ASSERT_EQUAL(0, sampleUntilAgreed(vals, SAMPLE_COUNT, &answer));
+    TEST_ASSERT_EQUAL(-2, answer);
+    TEST_ASSERT_EQUAL(400, median(vals, SAMPLE_COUNT));
+    TEST_ASSERT_EQUAL(250, median(vals, 3));
+    //median() doesn't reorder the caller's samples
+    TEST_ASSERT_EQUAL(400, vals[1]);
+    }
+
+static void test_single_sample_is_enough_when_one_is_needed()
+    {
+    int vals[]={321};
+    int answer=0;
+    TEST_ASSERT_TRUE(findConsensus(vals, 1, 1, TOLERANCE, &answer));
+    TEST_ASSERT_EQUAL(321, answer);
+    }
+
+/*
+ * What measure() did before findConsensus(): read the distance SAMPLE_COUNT
+ * times and return the dominant value, counting only exact matches.
+ */
+static int modeVote(int* vals)
+    {
+    int answer=0,answerCount=0;
+    for (int i=0;i<SAMPLE_COUNT-1;i++)
+        {
+        int candidate=vals[i];
+        int candidateCount=1;
+        for (int j=i+1;j<SAMPLE_COUNT;j++)
+            {
+            if (candidate==vals[j])
+                candidateCount++;
+            }
+        if (candidateCount>answerCount)
+            {
+            answer=candidate;
+            answerCount=candidateCount;
+            }
+        }
+    return answer;
+    }
+
+// What measure() does now: sample until enough agree, or take the median of them all
+static int consensusVote(int* vals, int* taken)
+    {
+    int answer=0;
+    *taken=sampleUntilAgreed(vals, SAMPLE_COUNT, &answer);
+    if (*taken)
+        return answer;
+    *taken=SAMPLE_COUNT;
+    return median(vals, SAMPLE_COUNT);
+    }
+
+static uint32_t nextRandom(uint32_t& state)
+    {
+    state=state*1103515245+12345;
+    return (state>>16) & 0x7FFF;
+    }
+
+/*
+ * A synthetic trace of a noisy sensor: each wake has a true distance, and
+ * each sample is that plus a few mm of Gaussian noise or, now and then, a
+ * wild reading from a stray reflection or a range that timed out. The mode
+ * vote only helps when samples match to the mm, which they seldom do.
+ */
+#define TRACE_WAKES 2000
+#define NOISE_MM 3.0
+#define WILD_PERCENT 10
+#define GOOD_ENOUGH 15 // mm from the truth that still counts as right
+
+static void makeTrace(int truth[TRACE_WAKES], int samples[TRACE_WAKES][SAMPLE_COUNT])
+    {
+    uint32_t state=22;
+    for (int w=0;w<TRACE_WAKES;w++)
+        {
+        truth[w]=100+nextRandom(state)%1900;
+        for (int s=0;s<SAMPLE_COUNT;s++)
+            {
+            if ((int)(nextRandom(state)%100)<WILD_PERCENT)
+                samples[w][s]=nextRandom(state)%2?8190:nextRandom(state)%2000;
+            else
+                {
+                //Box-Muller
+                double u1=(nextRandom(state)+1)/32769.0;
+                double u2=nextRandom(state)/32768.0;
+                double noise=sqrt(-2*log(u1))*cos(2*M_PI*u2)*NOISE_MM;
+                samples[w][s]=truth[w]+(int)lround(noise);
+                }
+            }
+        }
+    }
+
+static void test_replay_uses_fewer_samples_at_equal_accuracy()
+    {
+    static int truth[TRACE_WAKES];
+    static int samples[TRACE_WAKES][SAMPLE_COUNT];
+    makeTrace(truth, samples);
+
+    int modeRight=0, consensusRight=0;
+    long consensusSamples=0;
+    for (int w=0;w<TRACE_WAKES;w++)
+        {
+        if (abs(modeVote(samples[w])-truth[w])<=GOOD_ENOUGH)
+            modeRight++;
+        int taken;
+        if (abs(consensusVote(samples[w], &taken)-truth[w])<=GOOD_ENOUGH)
+            consensusRight++;
+        consensusSamples+=taken;
+        }
+
+    double modePerDecision=SAMPLE_COUNT;
+    double consensusPerDecision=(double)consensusSamples/TRACE_WAKES;
+    char message[120];
+    snprintf(message, sizeof(message), "mode vote: %.2f samples, %.1f%% right; consensus: %.2f samples, %.1f%% right",
+             modePerDecision, 100.0*modeRight/TRACE_WAKES, consensusPerDecision, 100.0*consensusRight/TRACE_WAKES);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_TRUE(consensusPerDecision<modePerDecision);
+    TEST_ASSERT_TRUE(consensusRight>=modeRight);
+    }
+
+int main(int argc, char** argv)
+    {
+    UNITY_BEGIN();
+    RUN_TEST(test_steady_samples_agree_early);
+    RUN_TEST(test_outlier_is_left_out);
+    RUN_TEST(test_group_is_measured_from_its_center);
+    RUN_TEST(test_no_agreement_falls_back_to_the_median);
+    RUN_TEST(test_single_sample_is_enough_when_one_is_needed);
+    RUN_TEST(test_replay_uses_fewer_samples_at_equal_accuracy);
+    return UNITY_END();
+    }
@@ -0,0 +1,138 @@
+/*
+ * How many frames a second the gateway can take before it starts losing
+ * them, in drain mode and with the single handleIncoming() slot. Reports
+ * from many nodes arrive at random times from a scripted UART with a real
+ * UART's receive buffer, and the application spends a fixed time on each
+ * frame it takes, as the gateway does publishing it.
+ * Build and run with: pio test -e native
+ */
+
+#include <unity.h>
+#include <RYLR998.h>
+#include <ScriptedUart.h>
+#include <math.h>
+
+#define UART_BUFFER 256     // bytes, the ESP8266's default serial receive buffer
+#define PROCESS_MS 20       // application time per frame taken
+#define LOOP_MS 5           // the rest of the application's loop
+#define RUN_MS 60000UL      // simulated time at each rate
+#define NODES 20
+
+static const int rates[]={1, 2, 5, 10, 15, 20, 30};
+#define RATE_COUNT (int)(sizeof(rates)/sizeof(rates[0]))
+
+void setUp() {}
+void tearDown() {}
+
+// The same pseudo random arrivals for both modes
+static uint32_t nextRandom(uint32_t& state)
+    {
+    state=state*1103515245+12345;
+    return (state>>16) & 0x7FFF;
+    }
+
+// Schedule reports from NODES nodes at an average of fps frames a second, returning how many
+static int scheduleFrames(ScriptedUart& uart, int fps)
+    {
+    uint32_t state=fps;
+    uint16_t sequence[NODES]={};
+    unsigned long at=0;
+    int count=0;
+    for (;;)
+        {
+        //exponential gaps, from a uniform draw
+        double u=(nextRandom(state)+1)/32769.0;
+        at+=(unsigned long)(-log(u)*1000.0/fps);
+        if (at>=RUN_MS)
+            return count;
+
+        int node=nextRandom(state)%NODES;
+        ReportFrame report={};
+        report.sequence=++sequence[node];
+        report.distance=1000+node;
+        report.batteryMv=3700;
+        char text[LORA_FRAME_TEXT_SIZE];
+        size_t len=RYLR998::encodeReport(report, text, sizeof(text));
+        char line[LORA_LINE_SIZE];
+        snprintf(line, sizeof(line), "+RCV=%d,%u,%s,-60,9\r\n", node+2, (unsigned int)len, text);
+        uart.inject(line, at);
+        count++;
+        }
+    }
+
+// Run the application against fps frames a second, returning the number of frames it lost
+static int framesLost(int fps, bool drainMode)
+    {
+    nativeMillis=0;
+    ScriptedUart uart;
+    uart.setCapacity(UART_BUFFER);
+    RYLR998 lora(uart);
+    StaticJsonDocument<250> doc;
+    lora.setJsonDocument(doc);
+    lora.setDrainMode(drainMode);
+
+    int sent=scheduleFrames(uart, fps);
+    int taken=0;
+    //run on a little after the last frame, so everything that can be taken is
+    while (millis()<RUN_MS+1000)
+        {
+        if (drainMode)
+            {
+            lora.drain();
+            while (lora.readFrame())
+                {
+                taken++;
+                nativeMillis+=PROCESS_MS;
+                }
+            }
+        else
+            {
+            while (lora.handleIncoming())
+                {
+                taken++;
+                nativeMillis+=PROCESS_MS;
+                }
+            }
+        nativeMillis+=LOOP_MS;
+        }
+    return sent-taken;
+    }
+
+static void test_frames_per_second_before_drops()
+    {
+    //the highest rate reached before the first loss
+    int sustainedDrain=0;
+    int sustainedSingle=0;
+    bool drainLost=false;
+    bool singleLost=false;
+    for (int i=0;i<RATE_COUNT;i++)
+        {
+        int lostDrain=framesLost(rates[i], true);
+        int lostSingle=framesLost(rates[i], false);
+        char message[100];
+        snprintf(message, sizeof(message), "%d frames/s for %lus: drain mode lost %d, single slot lost %d",
+                 rates[i], RUN_MS/1000, lostDrain, lostSingle);
+        TEST_MESSAGE(message);
+        drainLost|=lostDrain>0;
+        singleLost|=lostSingle>0;
+        if (!drainLost)
+            sustainedDrain=rates[i];
+        if (!singleLost)
+            sustainedSingle=rates[i];
+        }
+
+    char message[100];
+    snprintf(message, sizeof(message), "Sustained without loss: drain mode %d frames/s, single slot %d frames/s",
+             sustainedDrain, sustainedSingle);
+    TEST_MESSAGE(message);
+    //SF8 reports take 90ms on air, so one channel can't carry much over 10 a second
+    TEST_ASSERT_TRUE(sustainedDrain>=10);
+    TEST_ASSERT_TRUE(sustainedDrain>sustainedSingle);
+    }
+
+int main(int argc, char** argv)
+    {
+    UNITY_BEGIN();
+    RUN_TEST(test_frames_per_second_before_drops);
+    return UNITY_END();
+    }
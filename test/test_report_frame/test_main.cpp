@@ -0,0 +1,242 @@
+/*
+ * The binary report frame and +RCV parsing, and what the frame saves on air
+ * compared with the JSON the node used to send.
+ * Build and run with: pio test -e native
+ */
+
+#include <unity.h>
+#include <RYLR998.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Count heap allocations, so the parser can be shown not to make any
+static size_t allocations=0;
+
+void* operator new(size_t size)
+    {
+    allocations++;
+    void* p=malloc(size?size:1);
+    if (!p)
+        abort();
+    return p;
+    }
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// What publish() sent before the binary frame, for a typical reading
+static const char* const jsonReport="{\"distance\":1234,\"battery\":3.71,\"isPresent\":true}";
+
+// The node's default radio settings: SF8, 125kHz, 4/5, preamble 12
+#define SF 8
+#define BW 7
+#define CR 1
+#define PREAMBLE 12
+
+void setUp() {}
+void tearDown() {}
+
+static ReportFrame makeReport()
+    {
+    ReportFrame report={};
+    report.flags=LORA_FLAG_PRESENT;
+    report.sequence=0xBEEF;
+    report.distance=1234;
+    report.batteryMv=3710;
+    return report;
+    }
+
+static void test_report_round_trip()
+    {
+    ReportFrame report=makeReport();
+    char text[LORA_FRAME_TEXT_SIZE];
+    size_t len=RYLR998::encodeReport(report, text, sizeof(text));
+    TEST_ASSERT_EQUAL(LORA_REPORT_TEXT_LENGTH, len);
+    TEST_ASSERT_EQUAL(len, strlen(text));
+    TEST_ASSERT_EQUAL(LORA_FRAME_MARKER, text[0]);
+    //nothing AT+SEND or the +RCV parser would trip over
+    TEST_ASSERT_NULL(strpbrk(text, ",\r\n"));
+
+    ReportFrame decoded;
+    TEST_ASSERT_TRUE(RYLR998::decodeReport(text, len, decoded));
+    TEST_ASSERT_EQUAL(LORA_FRAME_VERSION, decoded.version);
+    TEST_ASSERT_EQUAL(report.flags, decoded.flags);
+    TEST_ASSERT_EQUAL(report.sequence, decoded.sequence);
+    TEST_ASSERT_EQUAL(report.distance, decoded.distance);
+    TEST_ASSERT_EQUAL(report.batteryMv, decoded.batteryMv);
+    TEST_ASSERT_EQUAL(0, decoded.readingCount);
+    }
+
+static void test_batch_round_trip()
+    {
+    ReportFrame report=makeReport();
+    report.readingCount=3;
+    for (int i=0;i<report.readingCount;i++)
+        report.readings[i]={(uint16_t)(900*(3-i)), (uint16_t)(100+i), (uint16_t)(3700+i)};
+    char text[LORA_FRAME_TEXT_SIZE];
+    size_t len=RYLR998::encodeReport(report, text, sizeof(text));
+    TEST_ASSERT_TRUE(len>LORA_REPORT_TEXT_LENGTH);
+
+    ReportFrame decoded;
+    TEST_ASSERT_TRUE(RYLR998::decodeReport(text, len, decoded));
+    TEST_ASSERT_EQUAL(LORA_FRAME_VERSION_BATCH, decoded.version);
+    TEST_ASSERT_EQUAL(3, decoded.readingCount);
+    for (int i=0;i<3;i++)
+        {
+        TEST_ASSERT_EQUAL(report.readings[i].age, decoded.readings[i].age);
+        TEST_ASSERT_EQUAL(report.readings[i].distance, decoded.readings[i].distance);
+        TEST_ASSERT_EQUAL(report.readings[i].batteryMv, decoded.readings[i].batteryMv);
+        }
+    }
+
+static void test_full_batch_fits()
+    {
+    ReportFrame report=makeReport();
+    report.readingCount=LORA_MAX_BATCH;
+    char text[LORA_FRAME_TEXT_SIZE];
+    size_t len=RYLR998::encodeReport(report, text, sizeof(text));
+    TEST_ASSERT_EQUAL(LORA_FRAME_TEXT_SIZE-1, len);
+    TEST_ASSERT_EQUAL(0, RYLR998::encodeReport(report, text, len));
+    }
+
+static void test_bad_frames_are_rejected()
+    {
+    ReportFrame report=makeReport();
+    char text[LORA_FRAME_TEXT_SIZE];
+    size_t len=RYLR998::encodeReport(report, text, sizeof(text));
+    ReportFrame decoded;
+
+    TEST_ASSERT_FALSE(RYLR998::decodeReport(text, len-2, decoded));   //short
+    TEST_ASSERT_FALSE(RYLR998::decodeReport(text+1, len-1, decoded)); //no marker
+    text[3]='*';
+    TEST_ASSERT_FALSE(RYLR998::decodeReport(text, len, decoded));     //not base64url
+    report.readingCount=0;
+    RYLR998::encodeReport(report, text, sizeof(text));
+    text[1]='D'; //a version we don't know
+    TEST_ASSERT_FALSE(RYLR998::decodeReport(text, len, decoded));
+    TEST_ASSERT_FALSE(RYLR998::decodeReport(jsonReport, strlen(jsonReport), decoded));
+    }
+
+// Against the Semtech calculator: 28 payload symbols and a 16.25 symbol preamble of 2.048ms each
+static void test_time_on_air_formula()
+    {
+    TEST_ASSERT_EQUAL_UINT32(90624, loraTimeOnAir(SF, BW, CR, PREAMBLE, 12));
+    TEST_ASSERT_TRUE(loraTimeOnAir(SF, BW, CR, PREAMBLE, 13)>=loraTimeOnAir(SF, BW, CR, PREAMBLE, 12));
+    TEST_ASSERT_TRUE(loraTimeOnAir(SF+1, BW, CR, PREAMBLE, 12)>loraTimeOnAir(SF, BW, CR, PREAMBLE, 12));
+    }
+
+static void test_frame_is_smaller_than_json()
+    {
+    ReportFrame report=makeReport();
+    char text[LORA_FRAME_TEXT_SIZE];
+    size_t frameLen=RYLR998::encodeReport(report, text, sizeof(text));
+    size_t jsonLen=strlen(jsonReport);
+    uint32_t frameUs=loraTimeOnAir(SF, BW, CR, PREAMBLE, frameLen);
+    uint32_t jsonUs=loraTimeOnAir(SF, BW, CR, PREAMBLE, jsonLen);
+
+    char message[100];
+    snprintf(message, sizeof(message), "JSON %u bytes %luus on air, frame %u bytes %luus on air",
+             (unsigned int)jsonLen, (unsigned long)jsonUs, (unsigned int)frameLen, (unsigned long)frameUs);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_TRUE(frameLen*3<jsonLen);
+    TEST_ASSERT_TRUE(frameUs*3<jsonUs*2);
+    }
+
+static void test_parse_rcv()
+    {
+    RcvFrame frame;
+    TEST_ASSERT_TRUE(RYLR998::parseRcv("+RCV=12,5,HELLO,-45,11", frame));
+    TEST_ASSERT_EQUAL(12, frame.address);
+    TEST_ASSERT_EQUAL(5, frame.length);
+    TEST_ASSERT_EQUAL(5, frame.payloadLen);
+    TEST_ASSERT_EQUAL_STRING_LEN("HELLO", frame.payload, 5);
+    TEST_ASSERT_EQUAL(-45, frame.rssi);
+    TEST_ASSERT_EQUAL(11, frame.snr);
+
+    TEST_ASSERT_TRUE(RYLR998::parseRcv("+RCV=1,2,hi,-100,-3", frame));
+    TEST_ASSERT_EQUAL(-100, frame.rssi);
+    TEST_ASSERT_EQUAL(-3, frame.snr);
+    }
+
+// JSON payloads have commas of their own
+static void test_parse_rcv_payload_with_commas()
+    {
+    RcvFrame frame;
+    TEST_ASSERT_TRUE(RYLR998::parseRcv("+RCV=3,13,{\"a\":1,\"b\":2},-60,8", frame));
+    TEST_ASSERT_EQUAL(13, frame.payloadLen);
+    TEST_ASSERT_EQUAL_STRING_LEN("{\"a\":1,\"b\":2}", frame.payload, 13);
+    TEST_ASSERT_EQUAL(-60, frame.rssi);
+    TEST_ASSERT_EQUAL(8, frame.snr);
+    }
+
+static void test_parse_rcv_rejects_junk()
+    {
+    RcvFrame frame;
+    TEST_ASSERT_FALSE(RYLR998::parseRcv("+OK", frame));
+    TEST_ASSERT_FALSE(RYLR998::parseRcv("+RCV=1,2,hi", frame));
+    TEST_ASSERT_FALSE(RYLR998::parseRcv("+RCV=,2,hi,-40,9", frame));
+    TEST_ASSERT_FALSE(RYLR998::parseRcv("+RCV=1,2,hi,-40,", frame));
+    TEST_ASSERT_FALSE(RYLR998::parseRcv("+RCV=1", frame));
+    }
+
+// A mix of binary reports, JSON and short payloads, parsed over and over
+static void test_parse_rcv_corpus()
+    {
+    std::vector<std::string> corpus;
+    for (int i=0;i<1000;i++)
+        {
+        ReportFrame report=makeReport();
+        report.sequence=i;
+        report.distance=i*7;
+        char text[LORA_FRAME_TEXT_SIZE];
+        size_t len=RYLR998::encodeReport(report, text, sizeof(text));
+        char line[LORA_LINE_SIZE];
+        if (i%3==0)
+            snprintf(line, sizeof(line), "+RCV=%d,%u,%s,-%d,%d", i%250+1, (unsigned int)len, text, 40+i%80, i%20-8);
+        else if (i%3==1)
+            snprintf(line, sizeof(line), "+RCV=%d,%u,%s,-%d,%d", i%250+1, (unsigned int)strlen(jsonReport), jsonReport, 40+i%80, i%20-8);
+        else
+            snprintf(line, sizeof(line), "+RCV=%d,2,ok,-%d,%d", i%250+1, 40+i%80, i%20-8);
+        corpus.push_back(line);
+        }
+
+    const int passes=100;
+    size_t parsed=0;
+    allocations=0;
+    auto start=std::chrono::steady_clock::now();
+    for (int pass=0;pass<passes;pass++)
+        {
+        for (const std::string& line : corpus)
+            {
+            RcvFrame frame;
+            if (RYLR998::parseRcv(line.c_str(), frame))
+                parsed++;
+            }
+        }
+    auto elapsed=std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start);
+    size_t made=allocations;
+
+    char message[100];
+    snprintf(message, sizeof(message), "%lu frames, %.1fns per frame, %lu allocations",
+             (unsigned long)parsed, (double)elapsed.count()/parsed, (unsigned long)made);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_EQUAL(passes*corpus.size(), parsed);
+    TEST_ASSERT_EQUAL(0, made);
+    }
+
+int main(int argc, char** argv)
+    {
+    UNITY_BEGIN();
+    RUN_TEST(test_report_round_trip);
+    RUN_TEST(test_batch_round_trip);
+    RUN_TEST(test_full_batch_fits);
+    RUN_TEST(test_bad_frames_are_rejected);
+    RUN_TEST(test_time_on_air_formula);
+    RUN_TEST(test_frame_is_smaller_than_json);
+    RUN_TEST(test_parse_rcv);
+    RUN_TEST(test_parse_rcv_payload_with_commas);
+    RUN_TEST(test_parse_rcv_rejects_junk);
+    RUN_TEST(test_parse_rcv_corpus);
+    return UNITY_END();
+    }
@@ -0,0 +1,435 @@
+/*
+ * The RYLR998 command engine and receive path, run against a scripted UART.
+ * Build and run with: pio test -e native
+ */
+
+#include <unity.h>
+#include <RYLR998.h>
+#include <ScriptedUart.h>
+
+#define MODULE_LATENCY 30   // ms the scripted module takes to answer a command
+
+static ScriptedUart* uart;
+static RYLR998* lora;
+
+void setUp()
+    {
+    nativeMillis=0;
+    uart=new ScriptedUart();
+    lora=new RYLR998(*uart);
+    }
+
+void tearDown()
+    {
+    delete lora;
+    delete uart;
+    }
+
+// Keep the engine going while the application does a millisecond of its own work per pass
+static void runFor(unsigned long ms)
+    {
+    unsigned long start=millis();
+    while (millis()-start<ms)
+        {
+        lora->service();
+        nativeMillis++;
+        }
+    }
+
+static void test_queued_command_returns_at_once()
+    {
+    uart->expect("AT+ADDRESS?", "+ADDRESS=3", MODULE_LATENCY);
+    int handle=lora->queueCommand("AT+ADDRESS?");
+    TEST_ASSERT_TRUE(handle>=0);
+    TEST_ASSERT_EQUAL_UINT32(0, millis());
+    TEST_ASSERT_FALSE(lora->isComplete(handle));
+
+    runFor(MODULE_LATENCY+5);
+    TEST_ASSERT_TRUE(lora->isComplete(handle));
+    TEST_ASSERT_FALSE(lora->isTimedOut(handle));
+    TEST_ASSERT_EQUAL_STRING("+ADDRESS=3", lora->getResponse(handle));
+    lora->release(handle);
+    TEST_ASSERT_FALSE(lora->isBusy());
+    TEST_ASSERT_EQUAL(0, uart->unexpected());
+    }
+
+static void test_commands_go_out_in_order()
+    {
+    uart->expect("AT+NETWORKID?", "+NETWORKID=18", MODULE_LATENCY);
+    uart->expect("AT+BAND?", "+BAND=915000000", MODULE_LATENCY);
+    uart->expect("AT+CRFOP?", "+CRFOP=22", MODULE_LATENCY);
+    int a=lora->queueCommand("AT+NETWORKID?");
+    int b=lora->queueCommand("AT+BAND?");
+    int c=lora->queueCommand("AT+CRFOP?");
+
+    //only one command is on the wire at a time
+    TEST_ASSERT_EQUAL(1, uart->sent().size());
+    runFor(4*MODULE_LATENCY);
+    TEST_ASSERT_EQUAL(3, uart->sent().size());
+    TEST_ASSERT_EQUAL_STRING("+NETWORKID=18", lora->getResponse(a));
+    TEST_ASSERT_EQUAL_STRING("+BAND=915000000", lora->getResponse(b));
+    TEST_ASSERT_EQUAL_STRING("+CRFOP=22", lora->getResponse(c));
+    TEST_ASSERT_EQUAL(0, uart->unexpected());
+    }
+
+static void test_silent_module_times_out()
+    {
+    int handle=lora->queueCommand("AT", nullptr, 100);
+    runFor(99);
+    TEST_ASSERT_FALSE(lora->isComplete(handle));
+    runFor(2);
+    TEST_ASSERT_TRUE(lora->isTimedOut(handle));
+    TEST_ASSERT_EQUAL_STRING("", lora->getResponse(handle));
+    TEST_ASSERT_EQUAL(1, lora->getStats().commands[LORA_CMD_TEST].timeouts);
+    }
+
+static int callbackHandle;
+static bool callbackTimedOut;
+
+static void onComplete(int handle, const char* response, bool timedOut)
+    {
+    callbackHandle=handle;
+    callbackTimedOut=timedOut;
+    }
+
+static void test_callback_frees_its_slot()
+    {
+    for (int i=0;i<LORA_COMMAND_QUEUE_SIZE;i++)
+        {
+        uart->expect("AT", "+OK", MODULE_LATENCY);
+        TEST_ASSERT_TRUE(lora->queueCommand("AT", onComplete)>=0);
+        }
+    TEST_ASSERT_EQUAL(-1, lora->queueCommand("AT"));
+
+    callbackHandle=-1;
+    runFor(2*MODULE_LATENCY);
+    TEST_ASSERT_TRUE(callbackHandle>=0);
+    TEST_ASSERT_FALSE(callbackTimedOut);
+    TEST_ASSERT_TRUE(lora->queueCommand("AT", onComplete)>=0);
+    }
+
+// A payload far longer than a queue slot goes out whole
+static void test_long_send_is_not_dropped()
+    {
+    char payload[101];
+    memset(payload, 'x', 100);
+    payload[100]='\0';
+    uart->expect("AT+SEND=1,100,", "+OK", MODULE_LATENCY);
+    TEST_ASSERT_TRUE(lora->send(1, String(payload)));
+    TEST_ASSERT_EQUAL(1, uart->sent().size());
+    TEST_ASSERT_EQUAL_STRING((String("AT+SEND=1,100,")+payload).c_str(), uart->sent()[0].c_str());
+    }
+
+static void test_busy_module_is_retried()
+    {
+    uart->expect("AT+SEND=1,2,", "+ERR=17", MODULE_LATENCY);
+    uart->expect("AT+SEND=1,2,", "+OK", MODULE_LATENCY);
+    TEST_ASSERT_TRUE(lora->send(1, String("hi")));
+    TEST_ASSERT_EQUAL(2, uart->sent().size());
+    TEST_ASSERT_EQUAL(1, lora->getStats().errors[LORA_ERR_TX_BUSY]);
+    }
+
+/*
+ * One wake's worth of radio work: check the module, set it up and send a
+ * report. Done through the blocking calls, all of the module's latency is
+ * time the node sits in the driver. Done through the queue, the driver
+ * returns straight away every time and the waiting is the application's.
+ */
+static const char* const wakeCommands[]={"AT", "AT+ADDRESS=3", "AT+NETWORKID=18", "AT+SEND=1,11,#AQAAAAAAAA"};
+static const int wakeCommandCount=sizeof(wakeCommands)/sizeof(wakeCommands[0]);
+
+static void scriptWake()
+    {
+    for (int i=0;i<wakeCommandCount;i++)
+        uart->expect(wakeCommands[i], "+OK", MODULE_LATENCY);
+    }
+
+static void test_time_blocked_per_wake()
+    {
+    scriptWake();
+    unsigned long start=millis();
+    TEST_ASSERT_TRUE(lora->testComm());
+    TEST_ASSERT_TRUE(lora->setAddress(3));
+    TEST_ASSERT_TRUE(lora->setNetworkID(18));
+    TEST_ASSERT_TRUE(lora->send(1, (const uint8_t*)"#AQAAAAAAAA", 11));
+    unsigned long blockingWake=millis()-start;
+    TEST_ASSERT_EQUAL(0, uart->unexpected());
+
+    tearDown();
+    setUp();
+    scriptWake();
+    int handles[wakeCommandCount];
+    unsigned long blocked=0;
+    for (int i=0;i<wakeCommandCount;i++)
+        {
+        unsigned long before=millis();
+        handles[i]=lora->queueCommand(wakeCommands[i]);
+        blocked+=millis()-before;
+        TEST_ASSERT_TRUE(handles[i]>=0);
+        }
+    start=millis();
+    while (lora->isBusy())
+        {
+        unsigned long before=millis();
+        lora->service();
+        blocked+=millis()-before;
+        nativeMillis++; //sampling, the console and the display get this time
+        }
+    unsigned long queuedWake=millis()-start;
+    for (int i=0;i<wakeCommandCount;i++)
+        TEST_ASSERT_EQUAL_STRING("+OK", lora->getResponse(handles[i]));
+    TEST_ASSERT_EQUAL(0, uart->unexpected());
+
+    char message[100];
+    snprintf(message, sizeof(message), "blocking wake: %lums in the driver; queued wake: %lums in the driver out of %lums",
+             blockingWake, blocked, queuedWake);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_TRUE(blockingWake>=wakeCommandCount*MODULE_LATENCY);
+    TEST_ASSERT_EQUAL_UINT32(0, blocked);
+    }
+
+// A queued send waits its turn without blocking, and writes the payload from the caller's buffer
+static void test_queued_send_returns_at_once()
+    {
+    static const uint8_t payload[]="#AQIDBA";
+    uart->expect("AT+ADDRESS?", "+ADDRESS=3", MODULE_LATENCY);
+    uart->expect("AT+SEND=1,7,#AQIDBA", "+OK", MODULE_LATENCY);
+    uart->expect("AT+SEND=1,7,", "+ERR=17", MODULE_LATENCY);
+    int query=lora->queueCommand("AT+ADDRESS?");
+    int send=lora->queueSend(1, payload, 7);
+    TEST_ASSERT_TRUE(send>=0);
+    TEST_ASSERT_EQUAL_UINT32(0, millis());
+    TEST_ASSERT_EQUAL(1, uart->sent().size());
+
+    runFor(2*MODULE_LATENCY+5);
+    TEST_ASSERT_TRUE(lora->isComplete(send));
+    TEST_ASSERT_EQUAL(LORA_OK, lora->getResult(send));
+    TEST_ASSERT_EQUAL_STRING("AT+SEND=1,7,#AQIDBA", uart->sent()[1].c_str());
+    lora->release(query);
+    lora->release(send);
+
+    send=lora->queueSend(1, payload, 7);
+    runFor(MODULE_LATENCY+5);
+    TEST_ASSERT_EQUAL(LORA_ERR_TX_BUSY, lora->getResult(send));
+    lora->release(send);
+    TEST_ASSERT_EQUAL(0, uart->unexpected());
+    }
+
+// A line split across reads is only handed on once it is whole
+static void test_partial_line_waits_for_the_rest()
+    {
+    lora->setDrainMode(true);
+    uart->inject("+RCV=7,5,hel", 0);
+    uart->inject("lo,-40,9\r\n", 10);
+    TEST_ASSERT_EQUAL(0, lora->drain());
+    nativeMillis=10;
+    TEST_ASSERT_EQUAL(1, lora->drain());
+    const ReceivedFrame* received=lora->readFrame();
+    TEST_ASSERT_NOT_NULL(received);
+    TEST_ASSERT_EQUAL(7, received->frame.address);
+    TEST_ASSERT_EQUAL_STRING_LEN("hello", received->frame.payload, 5);
+    TEST_ASSERT_EQUAL(5, received->frame.payloadLen);
+    TEST_ASSERT_EQUAL(-40, received->frame.rssi);
+    TEST_ASSERT_EQUAL(9, received->frame.snr);
+    TEST_ASSERT_NULL(lora->readFrame());
+    }
+
+// A frame that arrives while a command is waiting isn't taken for its reply
+static void test_frame_during_command()
+    {
+    lora->setDrainMode(true);
+    uart->expect("AT+ADDRESS?", "+ADDRESS=3", MODULE_LATENCY);
+    int handle=lora->queueCommand("AT+ADDRESS?");
+    uart->inject("+RCV=2,2,hi,-50,7\r\n", 5);
+    runFor(MODULE_LATENCY+5);
+    TEST_ASSERT_EQUAL_STRING("+ADDRESS=3", lora->getResponse(handle));
+    TEST_ASSERT_EQUAL(1, lora->drain());
+    TEST_ASSERT_EQUAL(2, lora->readFrame()->frame.address);
+    }
+
+static void test_overlong_line_is_cut_and_counted()
+    {
+    std::string line="+RCV=1,300,"+std::string(300, 'x')+",-40,9\r\n";
+    uart->inject(line.c_str(), 0);
+    uart->inject("+RCV=1,2,ok,-40,9\r\n", 0);
+    lora->setDrainMode(true);
+    runFor(5);
+    TEST_ASSERT_EQUAL(1, lora->getTruncatedLines());
+    TEST_ASSERT_EQUAL(0, lora->getRxOverflows());
+    //the cut line lost its signal fields, the next one is intact
+    const ReceivedFrame* received=lora->readFrame();
+    TEST_ASSERT_NOT_NULL(received);
+    TEST_ASSERT_EQUAL_STRING_LEN("ok", received->frame.payload, 2);
+    }
+
+// The frame readFrame() returned stays put while more arrive
+static void test_read_frame_survives_until_the_next_read()
+    {
+    lora->setDrainMode(true);
+    uart->inject("+RCV=1,5,first,-40,9\r\n", 0);
+    lora->drain();
+    const ReceivedFrame* first=lora->readFrame();
+    TEST_ASSERT_NOT_NULL(first);
+
+    for (int i=0;i<LORA_RX_QUEUE_DEPTH;i++)
+        uart->inject("+RCV=2,4,next,-40,9\r\n", 1);
+    nativeMillis=1;
+    TEST_ASSERT_EQUAL(LORA_RX_QUEUE_DEPTH-1, lora->drain());
+    TEST_ASSERT_EQUAL(1, lora->getDroppedFrames());
+    TEST_ASSERT_EQUAL_STRING_LEN("first", first->frame.payload, 5);
+    TEST_ASSERT_EQUAL(1, first->frame.address);
+
+    const ReceivedFrame* next=lora->readFrame();
+    TEST_ASSERT_EQUAL(2, next->frame.address);
+    }
+
+/*
+ * Listen before talk only knows about frames the module passes on, which
+ * are those addressed to this node or to broadcast. The scripted module
+ * stands for that: a frame it hands over makes the channel busy.
+ */
+static void test_channel_clear()
+    {
+    lora->setDrainMode(true);
+    TEST_ASSERT_TRUE(lora->channelClear(50));
+    TEST_ASSERT_TRUE(millis()>=50);
+
+    uart->inject("+RCV=1,3,ack,-60,9\r\n", millis()+20);
+    TEST_ASSERT_FALSE(lora->channelClear(50));
+    //the frame heard isn't lost
+    TEST_ASSERT_EQUAL(1, lora->drain());
+    TEST_ASSERT_TRUE(lora->channelClear(50));
+    }
+
+// A node that missed its ack sends the same report again: still handed on to be acked, but not expanded
+static void test_repeat_is_reported_for_an_ack()
+    {
+    StaticJsonDocument<250> doc;
+    lora->setJsonDocument(doc);
+    ReportFrame report={};
+    report.sequence=41;
+    report.distance=1234;
+    report.batteryMv=3700;
+    char text[LORA_FRAME_TEXT_SIZE];
+    size_t len=RYLR998::encodeReport(report, text, sizeof(text));
+    char line[LORA_LINE_SIZE];
+    snprintf(line, sizeof(line), "+RCV=5,%u,%s,-60,9\r\n", (unsigned int)len, text);
+
+    uart->inject(line, 0);
+    TEST_ASSERT_TRUE(lora->handleIncoming());
+    TEST_ASSERT_FALSE(lora->wasDuplicate());
+    TEST_ASSERT_EQUAL(1234, doc["distance"].as<int>());
+    TEST_ASSERT_FALSE(doc["dup"].as<bool>());
+
+    uart->inject(line, 1);
+    nativeMillis=1;
+    TEST_ASSERT_TRUE(lora->handleIncoming());
+    TEST_ASSERT_TRUE(lora->wasDuplicate());
+    TEST_ASSERT_TRUE(doc["dup"].as<bool>());
+    TEST_ASSERT_EQUAL(5, doc["address"].as<int>());
+    TEST_ASSERT_EQUAL(41, doc["seq"].as<int>());
+    TEST_ASSERT_FALSE(doc.containsKey("distance"));
+    TEST_ASSERT_EQUAL(1, lora->getDuplicateCount());
+    }
+
+// Replies that don't match what queryAll() read count as errors
+static void test_link_benchmark_counts_damaged_replies()
+    {
+    uart->expect("AT+ADDRESS?", "+ADDRESS=3", MODULE_LATENCY);
+    uart->expect("AT+NETWORKID?", "+NETWORKID=18", MODULE_LATENCY);
+    uart->expect("AT+BAND?", "+BAND=915000000", MODULE_LATENCY);
+    uart->expect("AT+IPR?", "+IPR=115200", MODULE_LATENCY);
+    uart->expect("AT+MODE?", "+MODE=0", MODULE_LATENCY);
+    uart->expect("AT+PARAMETER?", "+PARAMETER=8,7,1,12", MODULE_LATENCY);
+    uart->expect("AT+CPIN?", "+CPIN=No Password!", MODULE_LATENCY);
+    uart->expect("AT+CRFOP?", "+CRFOP=22", MODULE_LATENCY);
+    uart->expect("AT+PARAMETER?", "+PARAMETER=8,7,1,12", MODULE_LATENCY);
+    uart->expect("AT+PARAMETER?", "+PARAMETFR=8,7,1,12", MODULE_LATENCY);
+    uart->expect("AT+PARAMETER?", "+PARAMETER=8,7,1,12", MODULE_LATENCY);
+
+    LinkBenchmark result=lora->benchmarkLink(Serial, 3);
+    TEST_ASSERT_EQUAL(3, result.rounds);
+    TEST_ASSERT_EQUAL(1, result.errors);
+    TEST_ASSERT_EQUAL_UINT32(3*(strlen("+PARAMETER=8,7,1,12")+2), result.bytes);
+    TEST_ASSERT_EQUAL(0, uart->unexpected());
+    }
+
+// Looking for a silent module, every rate is tried once before any is tried again
+static void test_begin_tries_every_rate()
+    {
+    static const long rates[]={115200, 57600, 38400, 28800, 19200, 9600, 4800, 2400, 1200, 300};
+    RYLR998 bitBanged(4, 5);
+    SoftwareSerial::opened.clear();
+    TEST_ASSERT_FALSE(bitBanged.begin(9600));
+    TEST_ASSERT_TRUE(bitBanged.getDiscoveryTime()<=LORA_BEGIN_TIMEOUT+LORA_PROBE_TIMEOUT);
+    TEST_ASSERT_TRUE(SoftwareSerial::opened.size()>=sizeof(rates)/sizeof(rates[0]));
+    TEST_ASSERT_EQUAL(9600, SoftwareSerial::opened[0]);
+    for (long rate : rates)
+        {
+        auto it=std::find(SoftwareSerial::opened.begin(), SoftwareSerial::opened.end(), rate);
+        TEST_ASSERT_TRUE(it!=SoftwareSerial::opened.end());
+        TEST_ASSERT_TRUE(it-SoftwareSerial::opened.begin()<(long)(sizeof(rates)/sizeof(rates[0])));
+        }
+    }
+
+// A module that is powered off: one round of queries, then give up without writing anything
+static void test_apply_config_to_a_silent_module()
+    {
+    RadioConfig config={3, 18, 915000000, 8, 7, 1, 12, "", 22};
+    TEST_ASSERT_FALSE(lora->applyConfig(config));
+    TEST_ASSERT_EQUAL(LORA_TIMEOUT, lora->getLastResult());
+    TEST_ASSERT_EQUAL(8, uart->sent().size());
+    TEST_ASSERT_TRUE(millis()<=LORA_DEFAULT_TIMEOUT+10);
+    }
+
+// Nobody home: a command is tried twice, a send only once
+static void test_silent_module_costs_little()
+    {
+    TEST_ASSERT_FALSE(lora->testComm());
+    TEST_ASSERT_EQUAL(LORA_TIMEOUT, lora->getLastResult());
+    TEST_ASSERT_TRUE(millis()<=LORA_MAX_CALL_TIME);
+    TEST_ASSERT_TRUE(millis()>=2*LORA_DEFAULT_TIMEOUT);
+
+    unsigned long start=millis();
+    size_t lines=uart->sent().size();
+    TEST_ASSERT_FALSE(lora->send(1, String("hi")));
+    TEST_ASSERT_EQUAL(lines+1, uart->sent().size());
+    TEST_ASSERT_TRUE(millis()-start<=LORA_DEFAULT_TIMEOUT+10);
+    }
+
+// A slow module gets every attempt cut to what's left of the call's time
+static void test_call_time_is_capped()
+    {
+    uart->expect("AT+ADDRESS=3", "+ERR=2", 1900);
+    uart->expect("", "", 0);                      //the resync
+    uart->expect("AT+ADDRESS=3", "+ERR=2", 1900);
+    uart->expect("", "", 0);
+    uart->expect("AT+ADDRESS=3", "+OK", 1900);
+    TEST_ASSERT_FALSE(lora->setAddress(3));
+    TEST_ASSERT_TRUE(millis()<=LORA_MAX_CALL_TIME+LORA_RESYNC_WAIT+10);
+    }
+
+int main(int argc, char** argv)
+    {
+    UNITY_BEGIN();
+    RUN_TEST(test_queued_command_returns_at_once);
+    RUN_TEST(test_commands_go_out_in_order);
+    RUN_TEST(test_silent_module_times_out);
+    RUN_TEST(test_callback_frees_its_slot);
+    RUN_TEST(test_long_send_is_not_dropped);
+    RUN_TEST(test_busy_module_is_retried);
+    RUN_TEST(test_time_blocked_per_wake);
+    RUN_TEST(test_queued_send_returns_at_once);
+    RUN_TEST(test_partial_line_waits_for_the_rest);
+    RUN_TEST(test_frame_during_command);
+    RUN_TEST(test_overlong_line_is_cut_and_counted);
+    RUN_TEST(test_read_frame_survives_until_the_next_read);
+    RUN_TEST(test_channel_clear);
+    RUN_TEST(test_repeat_is_reported_for_an_ack);
+    RUN_TEST(test_link_benchmark_counts_damaged_replies);
+    RUN_TEST(test_begin_tries_every_rate);
+    RUN_TEST(test_apply_config_to_a_silent_module);
+    RUN_TEST(test_silent_module_costs_little);
+    RUN_TEST(test_call_time_is_capped);
+    return UNITY_END();
+    }